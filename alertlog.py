@@ -0,0 +1,263 @@
+#!/usr/bin/env python
+
+##
+# @file alertlog.py
+# @brief Non-blocking binary logging of the alerts and its offline conversion.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from argparse import ArgumentParser
+import exceptions
+import json
+import os
+import socket
+import struct
+import threading
+import time
+
+
+class AlertLogException(exceptions.Exception):
+    pass
+
+
+class AlertRing(object):
+    """
+    Class for a bounded single producer, single consumer ring of alerts.
+
+    The producer only writes the head and the consumer only writes the tail, and
+    a slot is filled before the head is advanced past it, so neither side takes
+    a lock; under CPython every index update is atomic. The producer never
+    waits: an alert which finds the ring full is dropped and counted.
+    """
+    def __init__(self, capacity = 1 << 16):
+        self._slots = [None] * capacity
+        self._capacity = capacity
+        self._head = 0
+        self._tail = 0
+        self.dropped = 0
+
+    def push(self, alert):
+        """
+        Adds an alert to the ring.
+        Returns False if the ring is full and the alert is dropped.
+        """
+        if self._head - self._tail == self._capacity:
+            self.dropped += 1
+            return False
+        self._slots[self._head % self._capacity] = alert
+        self._head += 1
+        return True
+
+    def pop_all(self):
+        """
+        Removes and returns all the alerts in the ring.
+        """
+        head = self._head
+        alerts = []
+        while self._tail < head:
+            position = self._tail % self._capacity
+            alerts.append(self._slots[position])
+            self._slots[position] = None
+            self._tail += 1
+        return alerts
+
+
+class AlertFile(object):
+    """
+    Class describing the binary format of the alert files.
+
+    The file starts with a magic string, which is followed by the records. Every
+    record starts with its type: an alert record holds the timestamp, SID, flow
+    5-tuple, offset in the buffer and the index of the keyword of the buffer; a
+    keyword record defines the index of a keyword and precedes its first use.
+    """
+    magic = 'SNAPALRT\x01'
+    ALERT = 0
+    KEYWORD = 1
+    _type = struct.Struct('<B')
+    _alert = struct.Struct('<dIB4sH4sHIH')
+    _keyword = struct.Struct('<HH')
+
+    @classmethod
+    def pack_alert(cls, timestamp, sid, key, keywordIndex, offset):
+        protocol, srcAddr, srcPort, dstAddr, dstPort = key
+        return cls._type.pack(cls.ALERT) + cls._alert.pack(timestamp, sid, protocol, srcAddr, srcPort, dstAddr,
+                                                           dstPort, offset, keywordIndex)
+
+    @classmethod
+    def pack_keyword(cls, keywordIndex, keyword):
+        return cls._type.pack(cls.KEYWORD) + cls._keyword.pack(keywordIndex, len(keyword)) + keyword
+
+    @classmethod
+    def alerts(cls, alertFile):
+        """
+        Yields the (timestamp, SID, flow key, keyword, offset) of every alert in the given file.
+        """
+        with open(alertFile, 'rb') as alerts:
+            if alerts.read(len(cls.magic)) != cls.magic:
+                raise AlertLogException, '\nFile "%s" is not an alert file.\n'%alertFile
+            keywords = {}
+            while True:
+                recordType = alerts.read(cls._type.size)
+                if not recordType:
+                    return
+                recordType = cls._type.unpack(recordType)[0]
+                if recordType == cls.KEYWORD:
+                    record = alerts.read(cls._keyword.size)
+                    if len(record) < cls._keyword.size:
+                        return
+                    index, length = cls._keyword.unpack(record)
+                    keyword = alerts.read(length)
+                    if len(keyword) < length:
+                        return
+                    keywords[index] = keyword
+                elif recordType == cls.ALERT:
+                    record = alerts.read(cls._alert.size)
+                    if len(record) < cls._alert.size:
+                        # the last record of a file which is still being written
+                        return
+                    timestamp, sid, protocol, srcAddr, srcPort, dstAddr, dstPort, offset, index = cls._alert.unpack(record)
+                    yield timestamp, sid, (protocol, srcAddr, srcPort, dstAddr, dstPort), keywords[index], offset
+                else:
+                    raise AlertLogException, '\nUnknown record type %d in file "%s".\n'%(recordType, alertFile)
+
+
+class AlertWriter(object):
+    """
+    Class for logging the alerts in the binary format from a dedicated thread.
+
+    The scanning thread only pushes the alerts to a ring; the writer thread
+    drains the ring in batches, packs them and writes every batch at once,
+    flushing and syncing the file periodically. The scanning thread therefore
+    never waits on the I/O; if the writer falls behind, the alerts are dropped.
+    """
+    def __init__(self, alertFile, capacity = 1 << 16, syncInterval = 1.0, pollInterval = 0.01):
+        self._file = open(alertFile, 'wb')
+        self._file.write(AlertFile.magic)
+        self._ring = AlertRing(capacity)
+        self._keywords = {}
+        self._syncInterval = syncInterval
+        self._pollInterval = pollInterval
+        self._closed = threading.Event()
+        self.written = 0
+        self._thread = threading.Thread(target = self._run)
+        self._thread.daemon = True
+        self._thread.start()
+
+    def __call__(self, timestamp, sid, key, keyword, offset):
+        self._ring.push((timestamp, sid, key, keyword, offset))
+
+    @property
+    def dropped(self):
+        return self._ring.dropped
+
+    def _write(self, alerts):
+        records = []
+        for timestamp, sid, key, keyword, offset in alerts:
+            index = self._keywords.get(keyword)
+            if index is None:
+                index = self._keywords[keyword] = len(self._keywords)
+                records.append(AlertFile.pack_keyword(index, keyword))
+            records.append(AlertFile.pack_alert(timestamp, sid, key, index, offset))
+        self._file.write(''.join(records))
+        self.written += len(alerts)
+
+    def _sync(self):
+        self._file.flush()
+        os.fsync(self._file.fileno())
+
+    def _run(self):
+        synced = time.time()
+        while not self._closed.is_set():
+            alerts = self._ring.pop_all()
+            if alerts:
+                self._write(alerts)
+            else:
+                self._closed.wait(self._pollInterval)
+            if time.time() - synced >= self._syncInterval:
+                self._sync()
+                synced = time.time()
+        self._write(self._ring.pop_all())
+        self._sync()
+
+    def close(self):
+        """
+        Writes the remaining alerts and closes the file.
+        """
+        self._closed.set()
+        self._thread.join()
+        self._file.close()
+
+
+def alert_json(alert):
+    timestamp, sid, (protocol, srcAddr, srcPort, dstAddr, dstPort), keyword, offset = alert
+    return json.dumps({'timestamp' : timestamp, 'sid' : sid, 'protocol' : protocol,
+                       'src' : '%s:%d'%(socket.inet_ntoa(srcAddr), srcPort),
+                       'dst' : '%s:%d'%(socket.inet_ntoa(dstAddr), dstPort),
+                       'buffer' : keyword, 'offset' : offset}, sort_keys = True)
+
+
+class Unified2Writer(object):
+    """
+    Class for writing the alerts as IPv4 events of the Snort unified2 format.
+    The generator of every event is the rules engine and its event ID is its
+    position in the file.
+    """
+    _header = struct.Struct('>II')
+    _event = struct.Struct('>IIIIIIIII4s4sHHBBBB')
+    # unified2 record type of the IPv4 events
+    IDS_EVENT = 7
+
+    def __init__(self, outFile, sensorId = 0):
+        self._file = open(outFile, 'wb')
+        self._sensorId = sensorId
+        self._eventId = 0
+
+    def __call__(self, alert):
+        timestamp, sid, (protocol, srcAddr, srcPort, dstAddr, dstPort), keyword, offset = alert
+        self._eventId += 1
+        seconds = int(timestamp)
+        event = self._event.pack(self._sensorId, self._eventId, seconds, int(round((timestamp - seconds) * 1e6)),
+                                 sid, 1, 0, 0, 0, srcAddr, dstAddr, srcPort, dstPort, protocol, 0, 0, 0)
+        self._file.write(self._header.pack(self.IDS_EVENT, len(event)) + event)
+
+    def close(self):
+        self._file.close()
+
+
+if __name__ == '__main__':
+    parser = ArgumentParser(description = 'Convert the binary alert files to Snort unified2 or JSON lines.')
+    parser.add_argument('alerts', help = 'the binary alert files', nargs = '+')
+    parser.add_argument('-f', '--format', help = 'format of the output',
+                        choices = ('json', 'unified2'), default = 'json')
+    parser.add_argument('-o', '--output', help = 'the output file',
+                        required = True, metavar = 'FILE')
+    args = parser.parse_args()
+
+    count = 0
+    if args.format == 'unified2':
+        writer = Unified2Writer(args.output)
+        for alertFile in args.alerts:
+            for alert in AlertFile.alerts(alertFile):
+                writer(alert)
+                count += 1
+        writer.close()
+    else:
+        with open(args.output, 'wb') as output:
+            for alertFile in args.alerts:
+                for alert in AlertFile.alerts(alertFile):
+                    output.write(alert_json(alert) + '\n')
+                    count += 1
+    print 'Converted %d alerts'%count
@@ -0,0 +1,784 @@
+##
+# @file anmlsimulator.py
+# @brief Software simulation of the ANML-NFAs exported by RulesAnml.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from array import array
+from collections import deque
+import exceptions
+import re
+import xml.etree.ElementTree as ElementTree
+
+
+class SimulatorException(exceptions.Exception):
+    pass
+
+
+class AnmlSimulator(object):
+    """
+    Class for simulating an ANML-NFA on the CPU.
+
+    The enabled STEs are stored either as a sorted tuple of their indices, when
+    only a few of them are enabled, or as bits of a Python long. The simulation
+    switches between the two representations based on the number of enabled
+    STEs. The scan state is a tuple (offset, enabled STEs, counter values), or
+    only the offset if no STE is enabled and all the counters are zero, so that
+    it can be compared, stored per flow and shipped to other processes as is.
+
+    The elements are partitioned into weakly connected components, which for
+    the buckets built by RulesAnml are mostly one per rule, and the STEs of a
+    component are numbered contiguously. The counters and booleans are only
+    evaluated for the components with matched STEs or with a reason to stay
+    live, instead of for every element on every symbol.
+
+    Within a component, the STEs are numbered in breadth-first order from the
+    start STEs so that the STEs enabled together are close in the tables. The
+    successors are stored in the compressed sparse row format and the symbol
+    masks are stored per symbol, i.e. one column of the STE x symbol matrix per
+    byte, similar to the row decoding on the AP.
+
+    The STEs which enable themselves are not simulated through their successors.
+    A self-loop STE accepting every symbol, e.g. the '*' STE of a latch or '.*'
+    in the dotall mode, stays matched forever once enabled; such STEs are kept
+    in a sticky mask, which is read by the booleans on every symbol but is only
+    updated when a new STE is latched. The other self-loop STEs, e.g. '[^\n]*',
+    stay enabled through a single mask operation.
+    """
+    # map of ANML boolean element tags to the corresponding modes
+    _booleanTags = {
+        'and'      : 'and',
+        'or'       : 'or',
+        'nor'      : 'nor',
+        'nand'     : 'nand',
+        'inverter' : 'not',
+    }
+
+    # modes of the counter elements
+    _counterModes = ('latch', 'pulse', 'roll')
+
+    # ports of the counter elements
+    _countPort = 'cnt'
+    _resetPort = 'rst'
+
+    # orderings of the STEs within a component
+    _orderings = ('bfs', 'document')
+
+    def __init__(self, anmlFile, sparseThreshold = 32, ordering = 'bfs'):
+        """
+        Constructor. Reads the ANML-NFA from the given file.
+        The sparse representation of the enabled STEs is used as long as there
+        are not more than the given number of them. The STEs are numbered either
+        in breadth-first order or in the order of the ANML file.
+        """
+        if ordering not in self._orderings:
+            raise SimulatorException, '\nUnknown ordering "%s" of the STEs.\n'%ordering
+        self._sparseThreshold = sparseThreshold
+        self._ordering = ordering
+        self._steIds = []
+        self._steIndex = {}
+        self._specialIds = []
+        self._specialIndex = {}
+        self._parse(anmlFile)
+        self._lower_self_loops()
+        # starts and always evaluated components, before any suppression
+        self._unsuppressed = (self._allInputStarts, self._startOfDataStarts, self._liveComponents, self._eodComponents)
+        self._suppressed = frozenset()
+        self._build_sparse_tables()
+
+    @classmethod
+    def _symbol_mask(cls, symbolSet):
+        """
+        Returns a 256-bit mask of the symbols in the given ANML symbol set.
+        """
+        if symbolSet == '*':
+            return (1 << 256) - 1
+        try:
+            symbolPattern = re.compile(r'(?:%s)\Z'%symbolSet, re.DOTALL)
+        except re.error, e:
+            raise SimulatorException, '\nParsing symbol set "%s" failed.\n%s\n'%(symbolSet, str(e))
+        mask = 0
+        for symbol in xrange(256):
+            if symbolPattern.match(chr(symbol)):
+                mask |= 1 << symbol
+        return mask
+
+    @classmethod
+    def _network_elements(cls, anmlFile):
+        root = ElementTree.parse(anmlFile).getroot()
+        if root.tag != 'automata-network':
+            networks = root.findall('automata-network')
+            if len(networks) != 1:
+                raise SimulatorException, '\nExpected exactly one automata network in "%s".\n'%anmlFile
+            root = networks[0]
+        return list(root)
+
+    def _parse(self, anmlFile):
+        """
+        Builds the simulation tables from the elements in the given ANML file.
+        """
+        elements = self._network_elements(anmlFile)
+        components = self._components(elements)
+        # order the elements so that every component is contiguous
+        elements = [e for c, p, e in sorted((components[e.get('id')], p, e) for p, e in enumerate(elements))]
+        if self._ordering == 'bfs':
+            elements = self._bfs_order(elements, components)
+        self._numComponents = len(set(components.itervalues()))
+        # first pass assigns indices to all the elements
+        for element in elements:
+            elementId = element.get('id')
+            if element.tag == 'state-transition-element':
+                self._steIndex[elementId] = len(self._steIds)
+                self._steIds.append(elementId)
+            elif element.tag in self._booleanTags or element.tag == 'counter':
+                self._specialIndex[elementId] = len(self._specialIds)
+                self._specialIds.append(elementId)
+            else:
+                raise SimulatorException, '\nElement "%s" of type "%s" is not supported.\n'%(elementId, element.tag)
+
+        numStes = len(self._steIds)
+        numSpecials = len(self._specialIds)
+        self._steComponents = [components[elementId] for elementId in self._steIds]
+        self._specialComponents = [components[elementId] for elementId in self._specialIds]
+        # per symbol mask of all the STEs accepting the symbol
+        self._symbolMasks = [0] * 256
+        # per STE mask of all the symbols accepted by the STE
+        self._steSymbols = [0] * numStes
+        # STEs enabled on every symbol and only on the first symbol
+        self._allInputStarts = 0
+        self._startOfDataStarts = 0
+        # STEs activated by a matching STE
+        self._steSuccessors = [0] * numStes
+        # report codes of the reporting STEs
+        self._steReports = {}
+        self._reportMask = 0
+
+        # per special element: kind, mode/target, STE inputs and special inputs,
+        # separately for the count and reset ports of the counters
+        self._specialKinds = [None] * numSpecials
+        self._specialModes = [None] * numSpecials
+        self._specialTargets = [0] * numSpecials
+        self._specialEod = [False] * numSpecials
+        self._specialSteInputs = [0] * numSpecials
+        self._specialInputs = [[] for s in xrange(numSpecials)]
+        self._resetSteInputs = [0] * numSpecials
+        self._resetInputs = [[] for s in xrange(numSpecials)]
+        self._specialSuccessors = [0] * numSpecials
+        self._specialReports = {}
+        self._counterIndex = {}
+
+        for element in elements:
+            elementId = element.get('id')
+            if element.tag == 'state-transition-element':
+                index = self._steIndex[elementId]
+                bit = 1 << index
+                mask = self._symbol_mask(element.get('symbol-set'))
+                self._steSymbols[index] = mask
+                for symbol in xrange(256):
+                    if mask & (1 << symbol):
+                        self._symbolMasks[symbol] |= bit
+                start = element.get('start', 'none')
+                if start == 'all-input':
+                    self._allInputStarts |= bit
+                elif start == 'start-of-data':
+                    self._startOfDataStarts |= bit
+                self._add_outputs(element, elementId, 'ste', index)
+            else:
+                index = self._specialIndex[elementId]
+                if element.tag == 'counter':
+                    self._specialKinds[index] = 'counter'
+                    mode = element.get('at-target', 'pulse')
+                    if mode not in self._counterModes:
+                        raise SimulatorException, '\nCounter "%s" has unknown mode "%s".\n'%(elementId, mode)
+                    self._specialModes[index] = mode
+                    self._specialTargets[index] = int(element.get('target'))
+                    self._counterIndex[index] = len(self._counterIndex)
+                else:
+                    self._specialKinds[index] = 'boolean'
+                    self._specialModes[index] = self._booleanTags[element.tag]
+                    self._specialEod[index] = element.get('eod', 'false') == 'true'
+                self._add_outputs(element, elementId, 'special', index)
+
+        self._numCounters = len(self._counterIndex)
+        # special elements of every component, in the order of evaluation
+        self._componentSpecials = {}
+        for index in self._topological_order():
+            self._componentSpecials.setdefault(self._specialComponents[index], []).append(index)
+        # components with eod booleans, all of which are evaluated at the end of data
+        self._eodComponents = frozenset(self._specialComponents[index] for index in xrange(numSpecials) if self._specialEod[index])
+        # components with booleans which are high without any input, e.g. NOR,
+        # and therefore need to be evaluated on every symbol
+        self._liveComponents = frozenset(self._specialComponents[index] for index in xrange(numSpecials)
+                                         if self._specialKinds[index] == 'boolean' and not self._specialEod[index] and
+                                            self._boolean_output(self._specialModes[index], 0, len(self._specialInputs[index]) + bin(self._specialSteInputs[index]).count('1')))
+        # components with eod booleans which are high without any input, which
+        # report at the end of data even if no STE ever matched
+        self._eodLiveComponents = frozenset(self._specialComponents[index] for index in xrange(numSpecials)
+                                            if self._specialKinds[index] == 'boolean' and self._specialEod[index] and
+                                               self._boolean_output(self._specialModes[index], 0, len(self._specialInputs[index]) + bin(self._specialSteInputs[index]).count('1')))
+
+    @classmethod
+    def _components(cls, elements):
+        """
+        Returns the map from the element IDs to the weakly connected component
+        of every element. The components are numbered in the order of appearance.
+        """
+        parents = {}
+        def find(elementId):
+            root = elementId
+            while parents[root] != root:
+                root = parents[root]
+            while parents[elementId] != root:
+                parents[elementId], elementId = root, parents[elementId]
+            return root
+        for element in elements:
+            parents[element.get('id')] = element.get('id')
+        for element in elements:
+            for child in element:
+                if child.tag.startswith('activate-on-'):
+                    target = child.get('element').rsplit(':', 1)[0] if ':' in child.get('element') else child.get('element')
+                    if target in parents:
+                        parents[find(target)] = find(element.get('id'))
+        components = {}
+        numbers = {}
+        for element in elements:
+            root = find(element.get('id'))
+            if root not in numbers:
+                numbers[root] = len(numbers)
+            components[element.get('id')] = numbers[root]
+        return components
+
+    @classmethod
+    def _bfs_order(cls, elements, components):
+        """
+        Reorders the STEs of every component in the breadth-first order from its
+        start STEs. The special elements of a component follow its STEs.
+        """
+        stes = dict((e.get('id'), e) for e in elements if e.tag == 'state-transition-element')
+        ordered = []
+        begin = 0
+        while begin < len(elements):
+            component = components[elements[begin].get('id')]
+            end = begin
+            while end < len(elements) and components[elements[end].get('id')] == component:
+                end += 1
+            members = elements[begin:end]
+            queue = deque(e.get('id') for e in members if e.tag == 'state-transition-element' and e.get('start', 'none') != 'none')
+            visited = set(queue)
+            while True:
+                while queue:
+                    elementId = queue.popleft()
+                    ordered.append(stes[elementId])
+                    for child in stes[elementId]:
+                        target = child.get('element')
+                        if child.tag.startswith('activate-on-') and target in stes and target not in visited:
+                            visited.add(target)
+                            queue.append(target)
+                # STEs only reachable through the special elements
+                remaining = [e.get('id') for e in members if e.tag == 'state-transition-element' and e.get('id') not in visited]
+                if not remaining:
+                    break
+                visited.add(remaining[0])
+                queue.append(remaining[0])
+            ordered.extend(e for e in members if e.tag != 'state-transition-element')
+            begin = end
+        return ordered
+
+    def _add_outputs(self, element, elementId, kind, index):
+        """
+        Records the activation edges and the report code of the given element.
+        """
+        for child in element:
+            if child.tag.startswith('activate-on-'):
+                target = child.get('element')
+                port = None
+                if ':' in target:
+                    target, port = target.rsplit(':', 1)
+                if target in self._steIndex:
+                    if kind == 'ste':
+                        self._steSuccessors[index] |= 1 << self._steIndex[target]
+                    else:
+                        self._specialSuccessors[index] |= 1 << self._steIndex[target]
+                elif target in self._specialIndex:
+                    targetIndex = self._specialIndex[target]
+                    if port == self._resetPort:
+                        if kind == 'ste':
+                            self._resetSteInputs[targetIndex] |= 1 << index
+                        else:
+                            self._resetInputs[targetIndex].append(index)
+                    else:
+                        if kind == 'ste':
+                            self._specialSteInputs[targetIndex] |= 1 << index
+                        else:
+                            self._specialInputs[targetIndex].append(index)
+                else:
+                    raise SimulatorException, '\nElement "%s" activates unknown element "%s".\n'%(elementId, target)
+            elif child.tag.startswith('report-on-'):
+                reportCode = child.get('reportcode', elementId)
+                try:
+                    reportCode = int(reportCode)
+                except ValueError:
+                    pass
+                if kind == 'ste':
+                    self._steReports[index] = reportCode
+                    self._reportMask |= 1 << index
+                else:
+                    self._specialReports[index] = reportCode
+
+    @staticmethod
+    def _indices(mask):
+        """
+        Returns the indices of the set bits in the given mask.
+        """
+        indices = []
+        while mask:
+            low = mask & -mask
+            indices.append(low.bit_length() - 1)
+            mask ^= low
+        return indices
+
+    @staticmethod
+    def _mask(indices):
+        """
+        Returns the mask with the bits at the given indices set.
+        """
+        mask = 0
+        for index in indices:
+            mask |= 1 << index
+        return mask
+
+    def _lower_self_loops(self):
+        """
+        Removes the self-loops from the successors and records the self-loop STEs
+        in separate masks. The start and the reporting STEs are never made sticky.
+        """
+        allSymbols = (1 << 256) - 1
+        starts = self._allInputStarts | self._startOfDataStarts
+        self._selfLoops = 0
+        self._stickyMask = 0
+        for index in xrange(len(self._steIds)):
+            bit = 1 << index
+            if self._steSuccessors[index] & bit:
+                self._steSuccessors[index] ^= bit
+                if self._steSymbols[index] == allSymbols and not (starts & bit) and index not in self._steReports:
+                    self._stickyMask |= bit
+                else:
+                    self._selfLoops |= bit
+        self._stickySet = frozenset(self._indices(self._stickyMask))
+
+    def _sticky_outputs(self, sticky):
+        """
+        Returns the STEs enabled by, and the components of, the given sticky STEs.
+        """
+        enabled = 0
+        components = set()
+        for index in self._indices(sticky):
+            enabled |= self._steSuccessors[index]
+            components.add(self._steComponents[index])
+        return enabled, components
+
+    def _build_sparse_tables(self):
+        """
+        Builds the index lists used when the enabled STEs are stored sparsely.
+        """
+        # successors of the STEs in the compressed sparse row format
+        self._successorOffsets = array('i', [0])
+        self._successorTargets = array('i')
+        for successors in self._steSuccessors:
+            self._successorTargets.extend(self._indices(successors))
+            self._successorOffsets.append(len(self._successorTargets))
+        self._specialSuccessorLists = [tuple(self._indices(m)) for m in self._specialSuccessors]
+        self._build_start_tables()
+
+    def _build_start_tables(self):
+        """
+        Builds the per symbol tables of the start STEs.
+        """
+        # STEs enabled on every symbol which also accept the symbol
+        self._startMatches = [self._allInputStarts & m for m in self._symbolMasks]
+        self._startMatchLists = [tuple(self._indices(m)) for m in self._startMatches]
+
+    def _topological_order(self):
+        """
+        Orders the special elements so that every element is evaluated after its inputs.
+        """
+        order = []
+        visited = [0] * len(self._specialIds)
+        def visit(index):
+            if visited[index] == 2:
+                return
+            if visited[index] == 1:
+                raise SimulatorException, '\nSpecial element "%s" is part of a cycle.\n'%self._specialIds[index]
+            visited[index] = 1
+            for inputIndex in self._specialInputs[index] + self._resetInputs[index]:
+                visit(inputIndex)
+            visited[index] = 2
+            order.append(index)
+        for index in xrange(len(self._specialIds)):
+            visit(index)
+        return order
+
+    @property
+    def numStes(self):
+        return len(self._steIds)
+
+    @property
+    def numSpecials(self):
+        return len(self._specialIds)
+
+    @property
+    def numComponents(self):
+        return self._numComponents
+
+    @property
+    def suppressed(self):
+        return self._suppressed
+
+    def report_codes(self):
+        """
+        Returns the set of the report codes of all the reporting elements.
+        """
+        return set(self._steReports.itervalues()).union(self._specialReports.itervalues())
+
+    def component_reports(self):
+        """
+        Returns the report codes of the reporting elements of every component.
+        """
+        reports = {}
+        for index, reportCode in self._steReports.iteritems():
+            reports.setdefault(self._steComponents[index], set()).add(reportCode)
+        for index, reportCode in self._specialReports.iteritems():
+            reports.setdefault(self._specialComponents[index], set()).add(reportCode)
+        return reports
+
+    def suppress(self, components):
+        """
+        Keeps the given components, e.g. those reporting only disabled rules,
+        from being started so that they are no longer simulated. The components
+        suppressed earlier are resumed. The STEs already enabled in a scan state
+        are not affected.
+        """
+        allInputStarts, startOfDataStarts, liveComponents, eodComponents = self._unsuppressed
+        components = frozenset(components)
+        self._suppressed = components
+        mask = self._mask(index for index, component in enumerate(self._steComponents) if component in components)
+        self._allInputStarts = allInputStarts & ~mask
+        self._startOfDataStarts = startOfDataStarts & ~mask
+        self._liveComponents = liveComponents.difference(components)
+        self._eodComponents = eodComponents.difference(components)
+        self._build_start_tables()
+
+    def initial_state(self, offset = 0):
+        """
+        Returns the scan state with no active STEs at the given offset.
+        """
+        return offset
+
+    def _expand_state(self, state):
+        if isinstance(state, tuple):
+            return state
+        return (state, (), (0,) * self._numCounters)
+
+    def compact_state(self, offset, enabled, counts):
+        """
+        Returns the smallest representation of the given scan state.
+        """
+        if isinstance(enabled, tuple):
+            if not enabled and not any(counts):
+                return offset
+        elif not enabled and not any(counts):
+            return offset
+        elif bin(enabled).count('1') <= self._sparseThreshold:
+            enabled = tuple(self._indices(enabled))
+        return (offset, enabled, tuple(counts))
+
+    @staticmethod
+    def state_offset(state):
+        """
+        Returns the offset of the next symbol to be scanned from the given state.
+        """
+        return state[0] if isinstance(state, tuple) else state
+
+    @classmethod
+    def same_configuration(cls, first, second):
+        """
+        Checks if the two scan states will behave identically on the same input.
+        """
+        if not isinstance(first, tuple) or not isinstance(second, tuple):
+            return not isinstance(first, tuple) and not isinstance(second, tuple)
+        firstEnabled = first[1] if not isinstance(first[1], tuple) else cls._mask(first[1])
+        secondEnabled = second[1] if not isinstance(second[1], tuple) else cls._mask(second[1])
+        return firstEnabled == secondEnabled and first[2] == second[2]
+
+    @staticmethod
+    def _boolean_output(mode, highCount, numInputs):
+        if mode == 'and':
+            return highCount == numInputs
+        elif mode == 'or':
+            return highCount > 0
+        elif mode == 'nand':
+            return highCount < numInputs
+        else:
+            return highCount == 0
+
+    def _evaluate_specials(self, matched, counts, eod, components, heldCounters):
+        """
+        Evaluates the counters and booleans of the given components in a cycle,
+        given the matched STEs. The latched counters at their target are tracked
+        in heldCounters, as they keep their components live.
+        Returns the indices of the special elements with high output.
+        """
+        outputs = []
+        high = set()
+        for component in components:
+            for index in self._componentSpecials.get(component, ()):
+                inputMask = self._specialSteInputs[index]
+                highCount = bin(matched & inputMask).count('1')
+                for inputIndex in self._specialInputs[index]:
+                    if inputIndex in high:
+                        highCount += 1
+                if self._specialKinds[index] == 'counter':
+                    counter = self._counterIndex[index]
+                    target = self._specialTargets[index]
+                    count = counts[counter]
+                    output = False
+                    reset = matched & self._resetSteInputs[index]
+                    for inputIndex in self._resetInputs[index]:
+                        reset = reset or inputIndex in high
+                    if reset:
+                        count = 0
+                    elif highCount > 0 and count < target:
+                        count += 1
+                        output = count == target
+                        if output and self._specialModes[index] == 'roll':
+                            count = 0
+                    if self._specialModes[index] == 'latch' and count == target:
+                        output = True
+                        heldCounters.add(index)
+                    else:
+                        heldCounters.discard(index)
+                    counts[counter] = count
+                else:
+                    if self._specialEod[index] and not eod:
+                        continue
+                    numInputs = bin(inputMask).count('1') + len(self._specialInputs[index])
+                    output = self._boolean_output(self._specialModes[index], highCount, numInputs)
+                if output:
+                    high.add(index)
+                    outputs.append(index)
+        outputs.sort()
+        return outputs
+
+    def successor_layout(self):
+        """
+        Returns the row offsets and the targets of the successors in the compressed
+        sparse row format.
+        """
+        return self._successorOffsets, self._successorTargets
+
+    def frontiers(self, data):
+        """
+        Generates the enabled and the matched STEs, as masks, for every symbol of
+        the given data. Only the STEs are simulated, which is enough for analyzing
+        the memory accesses of a layout.
+        """
+        enabled = 0
+        for position in xrange(len(data)):
+            matched, following = self.step(enabled, ord(data[position]), position == 0)
+            yield enabled, matched
+            enabled = following
+
+    def step_tables(self):
+        """
+        Returns the tables read by step: the mask of the STEs accepting every
+        symbol, the mask of the start STEs matching every symbol, the successors
+        of every STE and the mask of the STEs which stay enabled once matched.
+        """
+        return self._symbolMasks, self._startMatches, self._steSuccessors, self._selfLoops | self._stickyMask
+
+    def evaluated_specials(self, matched, eod = False):
+        """
+        Returns the special elements evaluated in a cycle with the given matched
+        STEs: those of the components with a matched STE, of the live components
+        and, at the end of data, of the components with eod booleans. The latched
+        STEs and counters, which also keep their components live, are not tracked.
+        """
+        components = set(self._steComponents[index] for index in self._indices(matched))
+        components.update(self._liveComponents)
+        if eod:
+            components.update(self._eodComponents)
+        specials = []
+        for component in components:
+            specials.extend(self._componentSpecials.get(component, ()))
+        return specials
+
+    def step(self, enabled, symbol, first = False):
+        """
+        Simulates the STEs, but not the counters and booleans, on one symbol.
+        Returns the matched STEs and the STEs enabled for the next symbol, as masks.
+        """
+        matched = (enabled & self._symbolMasks[symbol]) | self._startMatches[symbol]
+        if first:
+            matched |= self._startOfDataStarts & self._symbolMasks[symbol]
+        following = matched & (self._selfLoops | self._stickyMask)
+        for index in self._indices(matched):
+            following |= self._steSuccessors[index]
+        return matched, following
+
+    def step_reports(self, matched):
+        """
+        Returns the report codes of the given matched STEs.
+        """
+        return [self._steReports[index] for index in self._indices(matched & self._reportMask)]
+
+    def start_symbols(self):
+        """
+        Returns the symbols accepted by the all-input start STEs and by the
+        start-of-data STEs, or None if a boolean, including an eod boolean, may
+        be high without any match.
+        """
+        if self._liveComponents or self._eodLiveComponents.intersection(self._eodComponents):
+            return None
+        starts = [symbol for symbol in xrange(256) if self._startMatches[symbol]]
+        startOfData = [symbol for symbol in xrange(256) if self._startOfDataStarts & self._symbolMasks[symbol]]
+        return starts, startOfData
+
+    def symbol_classes(self):
+        """
+        Returns the classes of symbols which are accepted by the same STEs,
+        as a list of representative symbols and the class of every symbol.
+        """
+        representatives = []
+        classes = bytearray(256)
+        seen = {}
+        for symbol in xrange(256):
+            column = (self._symbolMasks[symbol], self._startMatches[symbol])
+            if column not in seen:
+                seen[column] = len(representatives)
+                representatives.append(symbol)
+            classes[symbol] = seen[column]
+        return representatives, classes
+
+    def scan(self, data, state = None, final = True):
+        """
+        Scans the given data starting from the given state.
+        The last symbol is treated as the end of data if final is set.
+        Returns the list of (offset, report code) and the state after the scan.
+        """
+        if state is None:
+            state = self.initial_state()
+        offset, enabled, counts = self._expand_state(state)
+        counts = list(counts)
+        # the sticky STEs are stored with the enabled STEs in the state
+        if isinstance(enabled, tuple):
+            sticky = self._mask(self._stickySet.intersection(enabled))
+            enabled = tuple(i for i in enabled if i not in self._stickySet)
+        else:
+            sticky = enabled & self._stickyMask
+            enabled ^= sticky
+        stickyEnabled, stickyComponents = self._sticky_outputs(sticky)
+        stickyEnabledList = self._indices(stickyEnabled)
+        heldCounters = set(index for index, counter in self._counterIndex.iteritems()
+                           if self._specialModes[index] == 'latch' and counts[counter] == self._specialTargets[index])
+        reports = []
+        symbolMasks = self._symbolMasks
+        startMatches = self._startMatches
+        steSuccessors = self._steSuccessors
+        successorOffsets = self._successorOffsets
+        successorTargets = self._successorTargets
+        steComponents = self._steComponents
+        steReports = self._steReports
+        selfLoops = self._selfLoops
+        stickyMask = self._stickyMask
+        threshold = self._sparseThreshold
+        hasSpecials = len(self._specialIds) > 0
+        sparse = isinstance(enabled, tuple)
+        last = len(data) - 1
+        for position in xrange(len(data)):
+            symbol = ord(data[position])
+            # components with matched STEs in this cycle
+            components = set()
+            if sparse:
+                steSymbols = self._steSymbols
+                matched = set(i for i in enabled if (steSymbols[i] >> symbol) & 1)
+                matched.update(self._startMatchLists[symbol])
+                if offset == 0:
+                    matched.update(self._indices(self._startOfDataStarts & symbolMasks[symbol]))
+                enabled = set(stickyEnabledList)
+                for index in sorted(matched):
+                    if index in steReports:
+                        reports.append((offset, steReports[index]))
+                    if (selfLoops >> index) & 1:
+                        enabled.add(index)
+                    enabled.update(successorTargets[successorOffsets[index]:successorOffsets[index + 1]])
+                    components.add(steComponents[index])
+                matched = self._mask(matched) if hasSpecials else 0
+            else:
+                matched = (enabled & symbolMasks[symbol]) | startMatches[symbol]
+                if offset == 0:
+                    matched |= self._startOfDataStarts & symbolMasks[symbol]
+                reporting = matched & self._reportMask
+                while reporting:
+                    low = reporting & -reporting
+                    reports.append((offset, steReports[low.bit_length() - 1]))
+                    reporting ^= low
+                enabled = stickyEnabled | (matched & selfLoops)
+                remaining = matched
+                while remaining:
+                    low = remaining & -remaining
+                    index = low.bit_length() - 1
+                    enabled |= steSuccessors[index]
+                    components.add(steComponents[index])
+                    remaining ^= low
+            if hasSpecials:
+                eod = final and position == last
+                matched |= sticky
+                components.update(stickyComponents)
+                components.update(self._liveComponents)
+                components.update(self._specialComponents[index] for index in heldCounters)
+                if eod:
+                    components.update(self._eodComponents)
+                for index in self._evaluate_specials(matched, counts, eod, components, heldCounters):
+                    if sparse:
+                        enabled.update(self._specialSuccessorLists[index])
+                    else:
+                        enabled |= self._specialSuccessors[index]
+                    if index in self._specialReports:
+                        reports.append((offset, self._specialReports[index]))
+            if sparse:
+                latched = self._stickySet.intersection(enabled)
+                if latched:
+                    enabled.difference_update(latched)
+                    latched = self._mask(latched)
+                if len(enabled) > threshold:
+                    enabled = self._mask(enabled)
+                    sparse = False
+            else:
+                latched = enabled & stickyMask
+                if latched:
+                    enabled ^= latched
+                if bin(enabled).count('1') <= threshold // 2:
+                    enabled = set(self._indices(enabled))
+                    sparse = True
+            if latched and (latched & ~sticky):
+                sticky |= latched
+                stickyEnabled, stickyComponents = self._sticky_outputs(sticky)
+                stickyEnabledList = self._indices(stickyEnabled)
+            offset += 1
+        if sparse:
+            enabled = tuple(sorted(set(enabled).union(self._indices(sticky))))
+        else:
+            enabled |= sticky
+        return reports, self.compact_state(offset, enabled, counts)
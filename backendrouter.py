@@ -0,0 +1,173 @@
+##
+# @file backendrouter.py
+# @brief Selection of the backend which scans every rule.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import exceptions
+import json
+import os
+
+from hostverifier import RuleVerifier
+from lazydfa import LazyDfa
+
+
+class RouterException(exceptions.Exception):
+    pass
+
+
+class BackendRouter(object):
+    """
+    Class for routing every rule to the cheapest of the available backends:
+    the AP, a lazy DFA or an NFA simulation on the CPU, or the verification of
+    the original expressions on the host.
+
+    The costs are estimates of the time spent per scanned byte, in the units
+    of the time taken by one half-core of the AP. A rule on the AP costs the
+    fraction of the half-core it occupies, in STEs, counters and booleans, times
+    the clock divisor. The NFA cost grows with the number of STEs, while a DFA
+    costs a fixed table lookup per byte once its states are cached, but only
+    exists for rules without counters and booleans whose determinization, with
+    the other rules of its bucket, stays small.
+    """
+    backends = ('ap', 'dfa', 'nfa', 'host')
+
+    # name of the file describing the routing
+    fileName = 'backends.json'
+
+    # resources available in one half-core of the AP
+    halfCoreStes = 49152 / 2
+    halfCoreCounters = 768 / 2
+    halfCoreBooleans = 2304 / 2
+
+    # relative costs of scanning on the CPU
+    _nfaSteCost = 1.0 / 2000
+    _dfaCost = 0.002
+    _hostCost = 0.05
+
+    def __init__(self, allowedBackends, maxDfaStates = LazyDfa.maxStates):
+        """
+        Constructor. Only the given backends are considered for routing, and a
+        bucket is only scanned by a DFA if its complete DFA fits in the cache.
+        """
+        for backend in allowedBackends:
+            if backend not in self.backends:
+                raise RouterException, '\nUnknown backend "%s".\n'%backend
+        self._allowed = set(allowedBackends)
+        self.maxDfaStates = maxDfaStates
+        # backend of every bucket, routing of every rule and rules verified on the host per keyword
+        self._buckets = {}
+        self._rules = {}
+        self._verified = {}
+
+    def allows(self, backend):
+        return backend in self._allowed
+
+    @staticmethod
+    def bucket(keyword, backend):
+        """
+        Returns the bucket of a keyword for the rules scanned by the given backend.
+        """
+        return keyword if backend in ('ap', 'host') else '%s_%s'%(keyword, backend)
+
+    @classmethod
+    def half_core_fraction(cls, stes, counters, booleans):
+        """
+        Returns the fraction of the resources of a half-core used by an automaton.
+        """
+        return float(stes) / cls.halfCoreStes + float(counters) / cls.halfCoreCounters + \
+               float(booleans) / cls.halfCoreBooleans
+
+    def costs(self, stes, clockDivisor, counters, booleans, dfaStates, verifiable):
+        """
+        Returns the estimated costs of the allowed backends which can scan a rule.
+        """
+        costs = {}
+        if 'ap' in self._allowed and stes <= self.halfCoreStes and counters <= self.halfCoreCounters and \
+           booleans <= self.halfCoreBooleans:
+            costs['ap'] = self.half_core_fraction(stes, counters, booleans) * clockDivisor
+        if 'nfa' in self._allowed:
+            costs['nfa'] = stes * self._nfaSteCost
+        if 'dfa' in self._allowed and counters + booleans == 0 and dfaStates is not None:
+            costs['dfa'] = self._dfaCost
+        if 'host' in self._allowed and verifiable:
+            costs['host'] = self._hostCost
+        return costs
+
+    def route(self, keyword, sid, patterns, stes, clockDivisor, counters, booleans, dfaStates, approximated):
+        """
+        Routes a rule, given the resources of its automaton and the number of DFA
+        states of its bucket, and returns the backend.
+        The approximated rules are verified on the host when possible, as the
+        automata may report false positives for them.
+        """
+        verifiable = RuleVerifier.verifiable(patterns)
+        costs = self.costs(stes, clockDivisor, counters, booleans, dfaStates, verifiable)
+        if not costs:
+            raise RouterException, '\nNo backend can scan the rule with SID %d.\n'%sid
+        if approximated and 'host' in costs:
+            backend = 'host'
+        else:
+            backend = min(costs.iterkeys(), key = lambda b : (costs[b], self.backends.index(b)))
+        self._record(keyword, sid, patterns, backend, {
+            'stes' : stes,
+            'clock_divisor' : clockDivisor,
+            'counters' : counters,
+            'booleans' : booleans,
+            'dfa_states' : dfaStates,
+            'approximated' : approximated,
+            'costs' : costs,
+        })
+        return backend
+
+    def route_unsupported(self, keyword, sid, patterns, reason):
+        """
+        Routes a rule which could not be converted to an automaton to the host,
+        if allowed. Returns True if the rule was routed.
+        """
+        if 'host' not in self._allowed or not RuleVerifier.verifiable(patterns):
+            return False
+        self._record(keyword, sid, patterns, 'host', {'reason' : reason.strip()})
+        return True
+
+    def _record(self, keyword, sid, patterns, backend, info):
+        info['backend'] = backend
+        info['keyword'] = keyword
+        self._rules.setdefault(str(sid), []).append(info)
+        if backend == 'host':
+            self._verified.setdefault(keyword, []).append([sid, [list(pattern) for pattern in patterns]])
+
+    def add_bucket(self, bucket, backend):
+        """
+        Records the backend which scans the given bucket.
+        """
+        self._buckets[bucket] = backend
+
+    def backend(self, bucket):
+        return self._buckets.get(bucket, 'ap')
+
+    def verified_rules(self):
+        """
+        Returns the SIDs and the patterns of the rules verified on the host per keyword.
+        """
+        return self._verified
+
+    def export(self, directory):
+        """
+        Writes the routing to the given directory.
+        """
+        with open(os.path.join(directory, self.fileName), 'wb') as routingFile:
+            json.dump({'buckets' : self._buckets, 'rules' : self._rules, 'verify' : self._verified},
+                      routingFile, indent = 1, sort_keys = True)
@@ -0,0 +1,199 @@
+#!/usr/bin/env python
+
+##
+# @file convbench.py
+# @brief Benchmark of the conversion of pinned ruleset snapshots.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from argparse import ArgumentParser
+import exceptions
+import json
+import multiprocessing
+import os
+import platform
+import resource
+import shutil
+import tempfile
+import time
+
+from manifest import Manifest
+
+
+class BenchmarkException(exceptions.Exception):
+    pass
+
+
+class ConversionBenchmark(object):
+    """
+    Class for benchmarking RulesConverter on the pinned ruleset snapshots.
+
+    The pins file lists the snapshots, each a rules file in the directory of
+    the pins file with its SHA-1, and the configurations, each a list of the
+    options of fastsnap.py. Every snapshot is converted and exported with every
+    configuration in a process of its own, so that its peak RSS is its own, and
+    the rules per second, peak RSS, converted and unsupported SIDs and the STEs
+    of every bucket are recorded.
+    """
+    defaultPins = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'rulesets', 'pins.json')
+
+    def __init__(self, pinsFile = defaultPins):
+        self._pinsFile = pinsFile
+        self._directory = os.path.dirname(os.path.abspath(pinsFile))
+        with open(pinsFile, 'rb') as pinsJson:
+            pins = json.load(pinsJson)
+        self.snapshots = dict((str(name), snapshot) for name, snapshot in pins.get('snapshots', {}).iteritems())
+        self.configurations = dict((str(name), [str(option) for option in options])
+                                   for name, options in pins.get('configurations', {}).iteritems())
+
+    def pin(self, name, rulesFile):
+        """
+        Copies the given rules file next to the pins file and pins it as a snapshot.
+        """
+        fileName = os.path.basename(rulesFile)
+        target = os.path.join(self._directory, fileName)
+        if os.path.abspath(rulesFile) != target:
+            shutil.copyfile(rulesFile, target)
+        self.snapshots[name] = {'file' : fileName, 'sha1' : Manifest.file_hash(target)}
+        with open(self._pinsFile, 'wb') as pinsJson:
+            json.dump({'snapshots' : self.snapshots, 'configurations' : self.configurations}, pinsJson,
+                      indent = 1, sort_keys = True)
+
+    def snapshot_file(self, name):
+        """
+        Returns the rules file of the given snapshot, after checking its pin.
+        """
+        snapshot = self.snapshots[name]
+        rulesFile = os.path.join(self._directory, snapshot['file'])
+        if Manifest.file_hash(rulesFile) != snapshot['sha1']:
+            raise BenchmarkException, '\nSnapshot "%s" does not match its pin.\n'%name
+        return rulesFile
+
+    def run(self, snapshot, configuration):
+        """
+        Returns the measurements of the given snapshot with the given configuration.
+        """
+        rulesFile = self.snapshot_file(snapshot)
+        options = self.configurations[configuration]
+        # a new process for every run
+        pool = multiprocessing.Pool(1)
+        try:
+            result = pool.apply(_convert, (rulesFile, options))
+        finally:
+            pool.close()
+            pool.join()
+        result.update({'snapshot' : snapshot, 'configuration' : configuration, 'options' : options})
+        return result
+
+    @staticmethod
+    def host():
+        return {'platform' : platform.platform(), 'processor' : platform.processor(),
+                'python' : platform.python_version()}
+
+
+def _options(rulesFile, options):
+    """
+    Parses the given options of fastsnap.py for converting the given rules.
+    """
+    from fastsnap import build_parser
+    return build_parser().parse_args(list(options) + [rulesFile])
+
+def _convert(rulesFile, options):
+    """
+    Converts and exports the given rules with the given options of fastsnap.py.
+    Returns the measurements.
+    """
+    from backendrouter import BackendRouter
+    from rulesconverter import RulesConverter
+    RulesConverter.disableErrorMessages()
+    directory = tempfile.mkdtemp(prefix = 'convbench')
+    try:
+        args = _options(rulesFile, options)
+        router = BackendRouter(args.engines) if args.engines is not None else None
+        t1 = time.time()
+        converter = RulesConverter(directory, args.maxstes, args.maxrepeats, args.independent, args.negations,
+                                   args.backreferences, args.compile, args.hostbooleans, args.hostwindows, router)
+        converter.convert(args.rules)
+        t1 = time.time() - t1
+        t2 = time.time()
+        converter.export()
+        t2 = time.time() - t2
+        totalRules, patternRules, supportedRules, converted, unsupported = converter.statistics()
+        buckets = Manifest(directory).buckets
+        return {
+            'rules' : totalRules,
+            'pattern_rules' : patternRules,
+            'supported_rules' : supportedRules,
+            'convert_seconds' : t1,
+            'export_seconds' : t2,
+            'rules_per_second' : totalRules / max(t1 + t2, 1e-9),
+            'peak_rss_kb' : resource.getrusage(resource.RUSAGE_SELF).ru_maxrss,
+            'converted_sids' : len(converted),
+            'unsupported_sids' : len(unsupported),
+            'bucket_stes' : dict((bucket, b['stes']) for bucket, b in buckets.iteritems()),
+            'total_stes' : sum(b['stes'] for b in buckets.itervalues()),
+        }
+    finally:
+        shutil.rmtree(directory, ignore_errors = True)
+
+
+if __name__ == '__main__':
+    parser = ArgumentParser(description = 'Benchmark the conversion of the pinned ruleset snapshots.')
+    parser.add_argument('-p', '--pins', help = 'the pins file listing the snapshots and configurations',
+                        default = ConversionBenchmark.defaultPins, metavar = 'FILE')
+    parser.add_argument('-s', '--snapshots', help = 'comma separated snapshots to be converted, all by default',
+                        type = lambda snapshots : snapshots.split(','), metavar = 'S')
+    parser.add_argument('-c', '--configurations', help = 'comma separated configurations to be used, all by default',
+                        type = lambda configurations : configurations.split(','), metavar = 'C')
+    parser.add_argument('-o', '--out', help = 'file to which the results are written as JSON',
+                        metavar = 'FILE')
+    parser.add_argument('--baseline', help = 'results of an earlier run to be compared with',
+                        metavar = 'FILE')
+    parser.add_argument('--pin', help = 'pin the given rules file as the snapshot with the given name, and exit',
+                        nargs = 2, metavar = ('NAME', 'FILE'))
+    args = parser.parse_args()
+
+    benchmark = ConversionBenchmark(args.pins)
+    if args.pin is not None:
+        benchmark.pin(*args.pin)
+        print 'Pinned %s as snapshot "%s"'%(args.pin[1], args.pin[0])
+        raise SystemExit
+    baseline = {}
+    if args.baseline is not None:
+        with open(args.baseline, 'rb') as baselineJson:
+            for result in json.load(baselineJson)['results']:
+                baseline[(result['snapshot'], result['configuration'])] = result
+
+    results = []
+    print '%-20s %-16s %10s %10s %9s %11s %9s'%('snapshot', 'configuration', 'rules/s', 'RSS (KB)', 'converted',
+                                             'unsupported', 'STEs')
+    for snapshot in sorted(args.snapshots or benchmark.snapshots):
+        for configuration in sorted(args.configurations or benchmark.configurations):
+            result = benchmark.run(snapshot, configuration)
+            results.append(result)
+            print '%-20s %-16s %10.1f %10d %9d %11d %9d'%(snapshot, configuration, result['rules_per_second'],
+                  result['peak_rss_kb'], result['converted_sids'], result['unsupported_sids'], result['total_stes'])
+            previous = baseline.get((snapshot, configuration))
+            if previous is not None:
+                print '%-37s %+9.1f%% %+9.1f%% %+9d %+11d %+9d'%('  vs baseline',
+                      100.0 * (result['rules_per_second'] / max(previous['rules_per_second'], 1e-9) - 1),
+                      100.0 * (float(result['peak_rss_kb']) / max(previous['peak_rss_kb'], 1) - 1),
+                      result['converted_sids'] - previous['converted_sids'],
+                      result['unsupported_sids'] - previous['unsupported_sids'],
+                      result['total_stes'] - previous['total_stes'])
+    if args.out is not None:
+        with open(args.out, 'wb') as outJson:
+            json.dump({'host' : benchmark.host(), 'time' : time.time(), 'results' : results}, outJson,
+                      indent = 1, sort_keys = True)
@@ -24,21 +24,26 @@ import os
 import time
 import sys
 
+from backendrouter import BackendRouter
 from rulesconverter import RulesConverter
 
 
-if __name__ == '__main__':
-    def RulesPath(path):
-        allFiles = []
-        if os.path.isdir(path):
-            for subdirs, dirs, files in os.walk(path):
-                allFiles.extend(os.path.join(path, name) for name in files if name.endswith('.rules'))
-        elif os.path.isfile(path):
-            allFiles.append(path)
-        else:
-            raise ArgumentTypeError, 'The provided path is neither a file nor a directory!'
-        return allFiles
+def RulesPath(path):
+    allFiles = []
+    if os.path.isdir(path):
+        for subdirs, dirs, files in os.walk(path):
+            allFiles.extend(os.path.join(path, name) for name in files if name.endswith('.rules'))
+    elif os.path.isfile(path):
+        allFiles.append(path)
+    else:
+        raise ArgumentTypeError, 'The provided path is neither a file nor a directory!'
+    return allFiles
+
 
+def build_parser():
+    """
+    Returns the parser of the options, also used by convbench.py for its configurations.
+    """
     parser = ArgumentParser(description = 'Generate ANML-NFA/AP-FSM from Snort rules.')
     parser.add_argument('rules', help = 'the directory/file from which the Snort rules are to be read',
                         type = RulesPath)
@@ -54,10 +59,21 @@ if __name__ == '__main__':
                         action = 'store_true')
     parser.add_argument('-b', '--backreferences', help = 'handle back references in patterns',
                         action = 'store_true')
+    parser.add_argument('-x', '--hostbooleans', help = 'combine the independent patterns of a rule on the host',
+                        action = 'store_true')
+    parser.add_argument('-w', '--hostwindows', help = 'check the windows of negated dependent patterns on the host, if cheaper',
+                        action = 'store_true')
+    parser.add_argument('-e', '--engines', help = 'comma separated backends (%s) among which the rules are routed'%(', '.join(BackendRouter.backends)),
+                        type = lambda engines : engines.split(','), metavar = 'E')
     parser.add_argument('-c', '--compile', help = 'compile the generated ANML-NFAs to get AP-FSMs',
                         action = 'store_true')
     parser.add_argument('-l', '--logging', help = 'enable error logging',
                         action = 'store_true')
+    return parser
+
+
+if __name__ == '__main__':
+    parser = build_parser()
     args = parser.parse_args()
 
     if not os.path.exists(args.out):
@@ -66,8 +82,10 @@ if __name__ == '__main__':
     if args.logging:
         sys.stderr = open(os.path.join(args.out, 'error.log'), 'wb')
 
+    router = BackendRouter(args.engines) if args.engines is not None else None
+
     t1 = time.time()
-    converter = RulesConverter(args.out, args.maxstes, args.maxrepeats, args.independent, args.negations, args.backreferences, args.compile)
+    converter = RulesConverter(args.out, args.maxstes, args.maxrepeats, args.independent, args.negations, args.backreferences, args.compile, args.hostbooleans, args.hostwindows, router)
     # convert the rules
     converter.convert(args.rules)
     t1 = time.time() - t1
@@ -0,0 +1,228 @@
+##
+# @file flowtable.py
+# @brief Flow-keyed storage of the streaming scan state.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from collections import OrderedDict
+import sys
+import threading
+
+
+class FlowState(object):
+    """
+    Class for storing the scan state of a flow.
+    The scan state of every bucket, as returned by AnmlSimulator.scan, includes
+    the active STEs, i.e. the latches, and the counter values. It is stored in
+    the compact form, sparse or dense, returned by the simulator. The generation
+    of the buckets with which the flow is scanned is tracked separately.
+    """
+    __slots__ = ('key', 'lastSeen', 'states', 'size', 'generation')
+
+    # approximate size of an entry without any scan state
+    _baseSize = 128
+
+    def __init__(self, key, now):
+        self.key = key
+        self.lastSeen = now
+        self.states = {}
+        self.size = self._baseSize
+        self.generation = None
+
+    @classmethod
+    def state_size(cls, state):
+        """
+        Returns the approximate size of the given scan state in bytes.
+        An idle state is stored as only the offset.
+        """
+        if not isinstance(state, tuple):
+            return sys.getsizeof(state)
+        return sys.getsizeof(state) + sum(sys.getsizeof(s) for s in state)
+
+    def update(self, bucket, state):
+        """
+        Stores the scan state of the given bucket.
+        Returns the change in the size of the entry.
+        """
+        delta = self.state_size(state)
+        if bucket in self.states:
+            delta -= self.state_size(self.states[bucket])
+        self.states[bucket] = state
+        self.size += delta
+        return delta
+
+
+class FlowTable(object):
+    """
+    Class for storing the state of the flows, keyed by their 5-tuple.
+
+    The table is split into shards, each with its own lock and its own LRU
+    order, so that threads scanning different flows rarely contend. Every shard
+    gets an equal share of the memory cap; the least recently used flows of a
+    shard are evicted when the share is exceeded and the flows idle for longer
+    than the timeout are expired. Evicted and expired flows are passed to the
+    given callback so that their pending eod booleans can still be evaluated.
+    """
+    def __init__(self, shards = 64, memoryCap = 1 << 30, idleTimeout = 120.0, onEvict = None):
+        """
+        Constructor. Creates an empty table.
+        """
+        self._numShards = shards
+        self._shards = [OrderedDict() for s in xrange(shards)]
+        self._locks = [threading.Lock() for s in xrange(shards)]
+        self._sizes = [0] * shards
+        self._shardCap = memoryCap // shards
+        self._idleTimeout = idleTimeout
+        self._onEvict = onEvict
+        self.evictions = 0
+        self.expirations = 0
+
+    @staticmethod
+    def flow_key(protocol, srcAddr, srcPort, dstAddr, dstPort):
+        """
+        Returns the key of a flow, which is the same for both of its directions.
+        """
+        if (srcAddr, srcPort) > (dstAddr, dstPort):
+            srcAddr, srcPort, dstAddr, dstPort = dstAddr, dstPort, srcAddr, srcPort
+        return (protocol, srcAddr, srcPort, dstAddr, dstPort)
+
+    def _shard(self, key):
+        return hash(key) % self._numShards
+
+    def _release(self, flows):
+        """
+        Passes the flows removed from a shard to the callback, outside the lock.
+        """
+        if self._onEvict is not None:
+            for flow in flows:
+                self._onEvict(flow)
+
+    def _evict(self, shard, now):
+        """
+        Removes the expired flows and, if required, the least recently used flows
+        from the given shard. Must be called with the lock of the shard held.
+        """
+        flows = self._shards[shard]
+        removed = []
+        while flows:
+            key, flow = next(flows.iteritems())
+            if now - flow.lastSeen > self._idleTimeout:
+                self.expirations += 1
+            elif self._sizes[shard] > self._shardCap:
+                self.evictions += 1
+            else:
+                break
+            del flows[key]
+            self._sizes[shard] -= flow.size
+            removed.append(flow)
+        return removed
+
+    def _lookup(self, shard, key, now, removed):
+        """
+        Returns the flow with the given key, after moving it to the end of the LRU
+        order. A flow which has been idle for longer than the timeout is added to
+        the removed flows and replaced by a new one, whether or not it was already
+        evicted. Must be called with the lock of the shard held.
+        """
+        flows = self._shards[shard]
+        flow = flows.pop(key, None)
+        if flow is not None and now - flow.lastSeen > self._idleTimeout:
+            self.expirations += 1
+            self._sizes[shard] -= flow.size
+            removed.append(flow)
+            flow = None
+        if flow is None:
+            flow = FlowState(key, now)
+            self._sizes[shard] += flow.size
+        flow.lastSeen = now
+        flows[key] = flow
+        return flow
+
+    def lookup(self, key, now):
+        """
+        Returns the state of the flow with the given key, creating it if required.
+        """
+        shard = self._shard(key)
+        removed = []
+        with self._locks[shard]:
+            flow = self._lookup(shard, key, now, removed)
+            removed.extend(self._evict(shard, now))
+        self._release(removed)
+        return flow
+
+    def lookup_batch(self, keys, now):
+        """
+        Returns the states of the flows for a batch of packets, in the same order.
+        The keys are grouped by their shard so that every lock is taken only once
+        per batch.
+        """
+        byShard = {}
+        for position, key in enumerate(keys):
+            byShard.setdefault(self._shard(key), []).append(position)
+        found = [None] * len(keys)
+        for shard, positions in byShard.iteritems():
+            removed = []
+            with self._locks[shard]:
+                for position in positions:
+                    found[position] = self._lookup(shard, keys[position], now, removed)
+                removed.extend(self._evict(shard, now))
+            self._release(removed)
+        return found
+
+    def update(self, flow, bucket, state, now):
+        """
+        Stores the scan state of a bucket for the given flow, and moves the flow
+        to the end of the LRU order as it was just used.
+        """
+        shard = self._shard(flow.key)
+        with self._locks[shard]:
+            delta = flow.update(bucket, state)
+            flows = self._shards[shard]
+            # the flow may have been evicted since it was looked up
+            if flows.get(flow.key) is flow:
+                self._sizes[shard] += delta
+                del flows[flow.key]
+                flows[flow.key] = flow
+            flow.lastSeen = now
+            removed = self._evict(shard, now)
+        self._release(removed)
+
+    def remove(self, key):
+        """
+        Removes the flow with the given key, e.g. on a TCP FIN or RST.
+        Returns the removed flow or None.
+        """
+        shard = self._shard(key)
+        with self._locks[shard]:
+            flow = self._shards[shard].pop(key, None)
+            if flow is not None:
+                self._sizes[shard] -= flow.size
+        return flow
+
+    def expire(self, now):
+        """
+        Removes all the flows which have been idle for longer than the timeout.
+        """
+        for shard in xrange(self._numShards):
+            with self._locks[shard]:
+                removed = self._evict(shard, now)
+            self._release(removed)
+
+    def __len__(self):
+        return sum(len(flows) for flows in self._shards)
+
+    @property
+    def size(self):
+        return sum(self._sizes)
@@ -0,0 +1,133 @@
+##
+# @file hostcombiner.py
+# @brief Host-side combination of the reports of independent patterns.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import exceptions
+
+
+class CombinerException(exceptions.Exception):
+    pass
+
+
+class HostCombiner(object):
+    """
+    Class for evaluating the rules with multiple independent patterns on the host.
+
+    Every pattern of such a rule reports its own code, which encodes the SID of
+    the rule and the index of the pattern. The reports of a flow are collected
+    in a bitmap per SID and the AND/NOT of the patterns is evaluated at the end
+    of a buffer or of the flow. Within a flow, only the rules without negated
+    patterns can be satisfied before its end.
+    """
+    # flag which distinguishes the pattern report codes from the SIDs; the codes
+    # fit in 31 bits, so only the SIDs below 1 << 22 can be combined on the host
+    _patternFlag = 1 << 30
+    # number of bits used for the index of a pattern
+    _indexBits = 8
+
+    # name of the file listing the combined rules
+    fileName = 'combinations.txt'
+
+    @classmethod
+    def encode(cls, sid, index):
+        """
+        Returns the report code for the pattern with the given index in a rule.
+        """
+        if index >= (1 << cls._indexBits) or sid >= (cls._patternFlag >> cls._indexBits):
+            raise CombinerException, '\nUnable to encode pattern %d of rule with SID %d.\n'%(index, sid)
+        return cls._patternFlag | (sid << cls._indexBits) | index
+
+    @classmethod
+    def decode(cls, reportCode):
+        """
+        Returns the SID and the pattern index for a pattern report code,
+        or None for any other report code.
+        """
+        if not isinstance(reportCode, (int, long)) or not (reportCode & cls._patternFlag):
+            return None
+        reportCode ^= cls._patternFlag
+        return reportCode >> cls._indexBits, reportCode & ((1 << cls._indexBits) - 1)
+
+    @staticmethod
+    def format_rule(sid, negations):
+        """
+        Returns the line describing the patterns of a rule in the combinations file.
+        """
+        return '%d: %s\n'%(sid, ''.join('!' if negation else '+' for negation in negations))
+
+    def __init__(self, combinationsFile):
+        """
+        Constructor. Reads the rules to be combined from the given file.
+        """
+        # per SID masks of the patterns which must and must not be matched
+        self._required = {}
+        self._forbidden = {}
+        with open(combinationsFile, 'rb') as rulesFile:
+            for line in rulesFile:
+                line = line.strip()
+                if not line:
+                    continue
+                sid, negations = line.split(':')
+                sid = int(sid)
+                self._required[sid] = 0
+                self._forbidden[sid] = 0
+                for index, negation in enumerate(negations.strip()):
+                    if negation == '!':
+                        self._forbidden[sid] |= 1 << index
+                    else:
+                        self._required[sid] |= 1 << index
+        # rules which match when none of their patterns is seen
+        self._negatedOnly = [sid for sid, required in self._required.iteritems() if not required]
+
+    def __contains__(self, sid):
+        return sid in self._required
+
+    def update(self, matches, reports):
+        """
+        Records the pattern reports in the given per SID bitmaps of a flow.
+        Returns the other reports, which need no combination.
+        """
+        remaining = []
+        for report in reports:
+            decoded = self.decode(report[1])
+            if decoded is None:
+                remaining.append(report)
+            else:
+                sid, index = decoded
+                matches[sid] = matches.get(sid, 0) | (1 << index)
+        return remaining
+
+    def evaluate(self, matches, sids = None, final = True):
+        """
+        Returns the SIDs of the rules satisfied by the given per SID bitmaps.
+        Only the rules with the given SIDs are evaluated, if given. Unless the
+        bitmaps are final, the rules with negated patterns are not evaluated.
+        """
+        matched = []
+        for sid, bitmap in matches.iteritems():
+            required = self._required.get(sid)
+            if required and (bitmap & required) == required and not (bitmap & self._forbidden[sid]) and \
+               (final or not self._forbidden[sid]):
+                matched.append(sid)
+        if not final:
+            matched.sort()
+            return matched
+        for sid in self._negatedOnly:
+            if (sids is None or sid in sids) and not (matches.get(sid, 0) & self._forbidden[sid]):
+                matched.append(sid)
+        matched.sort()
+        return matched
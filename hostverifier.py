@@ -0,0 +1,258 @@
+##
+# @file hostverifier.py
+# @brief Host-side verification of the reports of the automata.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import exceptions
+import json
+import re
+
+
+class VerifierException(exceptions.Exception):
+    pass
+
+
+class WindowVerifier(object):
+    """
+    Class for checking the negated dependent patterns on the host.
+
+    For a pattern followed by a negated content with within, the automaton only
+    reports the hits of the pattern. The verifier then checks that the negated
+    expression does not match in the window of the given depth following every
+    hit, and replaces the hit by the report code of the rule, or of the pattern
+    if the rule is combined on the host. In a stream, the windows which are not
+    complete at the end of a segment are kept open, with the bytes seen in them,
+    until enough of the following segments is seen or the stream ends.
+    """
+    # flag which distinguishes the window report codes from the SIDs; the codes
+    # stay below the pattern flag of HostCombiner, so only the SIDs below 1 << 21
+    # can be encoded and the other windows are lowered in the automata instead
+    _windowFlag = 1 << 29
+    # number of bits used for the index of a pattern
+    _indexBits = 8
+
+    # name of the file listing the windows
+    fileName = 'windows.txt'
+
+    # map of the PCRE modifiers to the flags of the re module
+    _modifierFlags = {
+        'i' : re.IGNORECASE,
+        's' : re.DOTALL,
+        'm' : re.MULTILINE,
+        'x' : re.VERBOSE,
+    }
+
+    @classmethod
+    def encode(cls, sid, index = 0):
+        """
+        Returns the report code for the hits of the pattern with the given index in a rule.
+        """
+        if index >= (1 << cls._indexBits) or sid >= (cls._windowFlag >> cls._indexBits):
+            raise VerifierException, '\nUnable to encode window of pattern %d of rule with SID %d.\n'%(index, sid)
+        return cls._windowFlag | (sid << cls._indexBits) | index
+
+    @classmethod
+    def is_window(cls, reportCode):
+        return isinstance(reportCode, (int, long)) and bool(reportCode & cls._windowFlag)
+
+    @classmethod
+    def decode(cls, reportCode):
+        """
+        Returns the SID and the pattern index for a window report code,
+        or None for any other report code.
+        """
+        if not cls.is_window(reportCode):
+            return None
+        reportCode ^= cls._windowFlag
+        return reportCode >> cls._indexBits, reportCode & ((1 << cls._indexBits) - 1)
+
+    @staticmethod
+    def format_window(windowCode, reportCode, depth, expression):
+        """
+        Returns the line describing a window in the windows file.
+        """
+        return '%d: %d %d %s\n'%(windowCode, reportCode, depth, expression)
+
+    @classmethod
+    def parse(cls, expression):
+        """
+        Returns the pattern of the given /pattern/modifiers expression and the
+        flags of the re module for its modifiers.
+        """
+        matched = re.match(r'^/(?P<pattern>.*)/(?P<modifiers>\w*)$', expression)
+        if matched is None:
+            raise VerifierException, '\nUnable to parse expression "%s".\n'%expression
+        flags = 0
+        for modifier in matched.group('modifiers'):
+            if modifier not in cls._modifierFlags:
+                # e.g. anchoring or a buffer, which the re module cannot express
+                raise VerifierException, '\nUnsupported modifier "%s" in expression "%s".\n'%(modifier, expression)
+            flags |= cls._modifierFlags[modifier]
+        return matched.group('pattern'), flags
+
+    @classmethod
+    def compile(cls, expression):
+        return re.compile(*cls.parse(expression))
+
+    def __init__(self, windowsFile):
+        """
+        Constructor. Reads the windows from the given file.
+        """
+        self._windows = {}
+        with open(windowsFile, 'rb') as windows:
+            for line in windows:
+                line = line.rstrip('\r\n')
+                if not line:
+                    continue
+                windowCode, description = line.split(': ', 1)
+                reportCode, depth, expression = description.split(' ', 2)
+                self._windows[int(windowCode)] = (int(reportCode), int(depth), self.compile(expression))
+
+    def verify(self, data, reports, pending = None, final = True):
+        """
+        Checks the windows, in the given data, following the window reports.
+        The open windows of a stream, as (offset, window code, bytes of the window),
+        are given in the pending list, which is updated in place; their offsets are
+        relative to the given data and are negative as they started before it.
+        Returns the reports with the window reports replaced by the reports of the
+        rules whose negated expression was not found.
+        """
+        verified = []
+        opened = []
+        # the open windows started before the data, and so before its reports
+        for offset, windowCode, text in (pending or ()):
+            ruleCode, depth, expression = self._windows[windowCode]
+            text += data[:depth - len(text)]
+            if expression.match(text, 0, depth) is not None:
+                continue
+            if len(text) < depth and not final:
+                opened.append((offset - len(data), windowCode, text))
+            else:
+                verified.append((offset, ruleCode))
+        for offset, reportCode in reports:
+            window = self._windows.get(reportCode) if self.is_window(reportCode) else None
+            if window is None:
+                verified.append((offset, reportCode))
+                continue
+            ruleCode, depth, expression = window
+            if expression.match(data, offset + 1, offset + 1 + depth) is not None:
+                continue
+            if offset + 1 + depth > len(data) and not final and pending is not None:
+                opened.append((offset - len(data), reportCode, data[offset + 1:]))
+            else:
+                verified.append((offset, ruleCode))
+        if pending is not None:
+            pending[:] = opened
+        return verified
+
+
+class RuleVerifier(object):
+    """
+    Class for matching, on the host, the rules routed away from the automata.
+
+    A rule matches a buffer if all its patterns are found in the buffer and none
+    of its negated patterns is. A pattern with a negated dependent expression is
+    found only if, for one of its matches, the dependent expression does not
+    match within the given depth after the end of the match.
+    """
+    @classmethod
+    def compile_pattern(cls, pattern):
+        """
+        Returns the given (expression, negation, dependent) pattern of a rule
+        with its expressions compiled.
+        """
+        expression, negation, dependent = pattern
+        if dependent is not None:
+            dependent = (WindowVerifier.compile(dependent[0]), dependent[1])
+        return (WindowVerifier.compile(expression), negation, dependent)
+
+    @classmethod
+    def verifiable(cls, patterns):
+        """
+        Checks if all the given patterns can be matched using the re module.
+        """
+        try:
+            for pattern in patterns:
+                cls.compile_pattern(pattern)
+        except (VerifierException, re.error, OverflowError):
+            return False
+        return True
+
+    def __init__(self, backendsFile):
+        """
+        Constructor. Reads the rules to be verified from the routing file.
+        """
+        with open(backendsFile, 'rb') as routingFile:
+            verified = json.load(routingFile).get('verify', {})
+        self._rules = {}
+        self._sources = {}
+        for keyword, rules in verified.iteritems():
+            self._sources[str(keyword)] = rules
+            self._rules[str(keyword)] = [(sid, [self.compile_pattern(pattern) for pattern in patterns]) for sid, patterns in rules]
+
+    def keywords(self):
+        return self._rules.keys()
+
+    def sids(self):
+        return set(sid for rules in self._rules.itervalues() for sid, patterns in rules)
+
+    def rules(self, keyword):
+        """
+        Returns the rules of the given keyword as read from the routing file.
+        """
+        return self._sources.get(keyword, [])
+
+    @staticmethod
+    def found(data, expression, dependent, final = True):
+        """
+        Checks if the given compiled pattern, with its dependent window if any, is found in the data.
+        Unless the data is final, a match whose window extends past its end is not counted.
+        """
+        if dependent is None:
+            return expression.search(data) is not None
+        window, depth = dependent
+        position = 0
+        while position <= len(data):
+            matched = expression.search(data, position)
+            if matched is None:
+                return False
+            if (final or matched.end() + depth <= len(data)) and \
+               window.match(data, matched.end(), matched.end() + depth) is None:
+                return True
+            position = matched.start() + 1
+        return False
+
+    def verify(self, keyword, data, found = None, final = True):
+        """
+        Returns the SIDs of the rules of the given keyword which match the data.
+        The (SID, index) of the patterns found in the earlier segments of a
+        stream, if given, are read from and added to the found set. The rules
+        with negated patterns are only evaluated on the final segment.
+        """
+        if found is None:
+            found = set()
+        matched = []
+        for sid, patterns in self._rules.get(keyword, ()):
+            negated = False
+            for index, (expression, negation, dependent) in enumerate(patterns):
+                negated = negated or negation
+                if (sid, index) not in found and self.found(data, expression, dependent, final):
+                    found.add((sid, index))
+            if (final or not negated) and \
+               all(((sid, index) in found) != pattern[1] for index, pattern in enumerate(patterns)):
+                matched.append(sid)
+        matched.sort()
+        return matched
@@ -0,0 +1,86 @@
+##
+# @file httpslicer.py
+# @brief Slicing of the packet payloads into the buffers scanned by the buckets.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import re
+import urllib
+
+
+class HttpSlicer(object):
+    """
+    Class for slicing a payload into the buffers of the keywords, i.e. of the
+    buckets generated by RulesConverter.
+
+    A payload starting with an HTTP request or status line is sliced into the
+    HTTP buffers; every payload is also scanned by the general buckets. The
+    normalized buffers have the URI and the cookies percent-decoded and the
+    cookies removed from the headers, while the raw buffers are kept as seen.
+    Only the message headers and body within the payload of one packet are
+    sliced.
+    """
+    _requestLine = re.compile(r'(?P<method>[A-Z]+) (?P<uri>\S+) HTTP/\d\.\d\r?\n')
+    _statusLine = re.compile(r'HTTP/\d\.\d (?P<code>\d{3}) ?(?P<message>[^\r\n]*)\r?\n')
+    _headersEnd = re.compile(r'\r?\n\r?\n')
+    _cookieLine = re.compile(r'^(?:Set-)?Cookie:[ \t]*(?P<cookie>[^\r\n]*)\r?\n?', re.IGNORECASE | re.MULTILINE)
+
+    def __init__(self, keywords):
+        """
+        Constructor. Only the buffers of the given keywords are sliced.
+        """
+        self._keywords = frozenset(keywords)
+        self._http = any(keyword.startswith('http_') or keyword.startswith('file_data') for keyword in keywords)
+
+    def _slice_message(self, payload, buffers):
+        request = self._requestLine.match(payload)
+        status = self._statusLine.match(payload) if request is None else None
+        if request is None and status is None:
+            return False
+        start = (request or status).end()
+        end = self._headersEnd.search(payload, start)
+        headers = payload[start:end.start() + 2 if end is not None else len(payload)]
+        body = payload[end.end():] if end is not None else ''
+        if request is not None:
+            buffers['http_method'] = request.group('method')
+            buffers['http_uri_raw'] = request.group('uri')
+            buffers['http_uri'] = urllib.unquote(request.group('uri'))
+            buffers['http_client_body'] = body
+        else:
+            buffers['http_stat_code'] = status.group('code')
+            buffers['http_stat_msg'] = status.group('message')
+        buffers['file_data'] = body
+        buffers['http_header_raw'] = headers
+        buffers['http_header'] = self._cookieLine.sub('', headers)
+        cookies = '; '.join(matched.group('cookie') for matched in self._cookieLine.finditer(headers))
+        buffers['http_cookie_raw'] = cookies
+        buffers['http_cookie'] = urllib.unquote(cookies)
+        return True
+
+    def buffers(self, payload):
+        """
+        Returns the buffers of the given payload, by keyword.
+        """
+        buffers = {'general' : payload, 'pkt_data' : payload}
+        if not (self._http and self._slice_message(payload, buffers)):
+            buffers['file_data'] = payload
+        sliced = {}
+        for keyword in self._keywords:
+            if keyword in buffers:
+                sliced[keyword] = buffers[keyword]
+            elif keyword.endswith('_raw') and keyword[:-4] in buffers:
+                # the rules with rawbytes scan the buffer as seen
+                sliced[keyword] = buffers[keyword[:-4]]
+        return sliced
@@ -0,0 +1,145 @@
+#!/usr/bin/env python
+
+##
+# @file layoutbench.py
+# @brief Benchmark for comparing the memory layouts of the simulated buckets.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from argparse import ArgumentParser
+import os
+import random
+import time
+
+from anmlsimulator import AnmlSimulator
+
+
+class CacheModel(object):
+    """
+    Class for counting the misses of a set-associative LRU cache.
+    """
+    def __init__(self, size, lineSize, ways):
+        self._lineSize = lineSize
+        self._ways = ways
+        self._numSets = max(size // (lineSize * ways), 1)
+        self._sets = [[] for s in xrange(self._numSets)]
+        self.accesses = 0
+        self.misses = 0
+
+    def access(self, address, size = 1):
+        """
+        Accesses all the lines overlapping the given range of addresses.
+        """
+        for line in xrange(address // self._lineSize, (address + size - 1) // self._lineSize + 1):
+            self.accesses += 1
+            lines = self._sets[line % self._numSets]
+            if line in lines:
+                lines.remove(line)
+            else:
+                self.misses += 1
+                if len(lines) == self._ways:
+                    lines.pop(0)
+            lines.append(line)
+
+
+class LayoutBenchmark(object):
+    """
+    Class for replaying the memory accesses of the simulation of a bucket.
+
+    The tables are assumed to be laid out as arrays: the bits of the enabled
+    STEs, the symbol masks stored as one column of STE bits per symbol, of which
+    the bit of every enabled STE is read, the successors in the compressed
+    sparse row format and the records of the counters and booleans, which are
+    read when their components are evaluated.
+    """
+    # sizes, in bytes, of the table entries
+    _indexSize = 4
+    _specialSize = 16
+
+    def __init__(self, simulator, cacheSize, lineSize, ways):
+        self._simulator = simulator
+        self._cache = CacheModel(cacheSize, lineSize, ways)
+        numStes = simulator.numStes
+        # base addresses of the tables, each aligned to a page
+        self._columnSize = (numStes + 7) // 8
+        self._enabledBase = 0
+        self._maskBase = self._align(self._enabledBase + self._columnSize)
+        self._offsetBase = self._align(self._maskBase + 256 * self._columnSize)
+        self._targetBase = self._align(self._offsetBase + (numStes + 1) * self._indexSize)
+        self._specialBase = self._align(self._targetBase + len(simulator.successor_layout()[1]) * self._indexSize)
+
+    @staticmethod
+    def _align(address, alignment = 4096):
+        return (address + alignment - 1) // alignment * alignment
+
+    def run(self, data):
+        """
+        Replays the accesses for the given data and returns the cache statistics.
+        """
+        cache = self._cache
+        simulator = self._simulator
+        offsets, targets = simulator.successor_layout()
+        last = len(data) - 1
+        for position, (enabled, matched) in enumerate(simulator.frontiers(data)):
+            column = self._maskBase + ord(data[position]) * self._columnSize
+            for index in AnmlSimulator._indices(enabled):
+                cache.access(self._enabledBase + index // 8)
+                cache.access(column + index // 8)
+            for index in AnmlSimulator._indices(matched):
+                cache.access(self._offsetBase + index * self._indexSize, 2 * self._indexSize)
+                count = offsets[index + 1] - offsets[index]
+                if count > 0:
+                    cache.access(self._targetBase + offsets[index] * self._indexSize, count * self._indexSize)
+                    for target in targets[offsets[index]:offsets[index + 1]]:
+                        cache.access(self._enabledBase + target // 8)
+            for index in simulator.evaluated_specials(matched, position == last):
+                cache.access(self._specialBase + index * self._specialSize, self._specialSize)
+        return cache.accesses, cache.misses
+
+
+if __name__ == '__main__':
+    parser = ArgumentParser(description = 'Compare the cache behavior of the STE orderings of ANML-NFAs.')
+    parser.add_argument('anml', help = 'the ANML-NFA files to be benchmarked', nargs = '+')
+    parser.add_argument('-i', '--input', help = 'file with the input to be scanned; random bytes are used otherwise',
+                        metavar = 'FILE')
+    parser.add_argument('-s', '--size', help = 'number of random bytes to be scanned',
+                        type = int, default = 1 << 16, metavar = 'N')
+    parser.add_argument('--cache', help = 'size of the modeled cache in bytes',
+                        type = int, default = 32768, metavar = 'B')
+    parser.add_argument('--line', help = 'size of a cache line in bytes',
+                        type = int, default = 64, metavar = 'B')
+    parser.add_argument('--ways', help = 'associativity of the modeled cache',
+                        type = int, default = 8, metavar = 'W')
+    args = parser.parse_args()
+
+    if args.input is not None:
+        with open(args.input, 'rb') as inputFile:
+            data = inputFile.read()
+    else:
+        random.seed(0)
+        data = ''.join(chr(random.randint(0, 255)) for i in xrange(args.size))
+
+    for anmlFile in args.anml:
+        bucket = os.path.splitext(os.path.basename(anmlFile))[0]
+        for ordering in ('document', 'bfs'):
+            simulator = AnmlSimulator(anmlFile, ordering = ordering)
+            benchmark = LayoutBenchmark(simulator, args.cache, args.line, args.ways)
+            accesses, misses = benchmark.run(data)
+            t = time.time()
+            simulator.scan(data)
+            t = time.time() - t
+            print '%s (%s): %.3f accesses/byte, %.3f misses/byte, %.3f MB/s'%(bucket, ordering,
+                  float(accesses) / max(len(data), 1), float(misses) / max(len(data), 1),
+                  len(data) / (t * 1e6) if t > 0 else 0.0)
@@ -0,0 +1,207 @@
+##
+# @file lazydfa.py
+# @brief Lazily determinized scanning of the ANML-NFAs without counters and booleans.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from collections import deque
+
+from anmlsimulator import AnmlSimulator, SimulatorException
+
+
+class LazyDfa(object):
+    """
+    Class for scanning with a DFA which is built lazily from an ANML-NFA.
+
+    Every DFA state is a set of enabled STEs and its transitions, on the classes
+    of equivalent symbols, are computed by the simulator on first use. The cache
+    of states is flushed when it grows beyond the given number of states, which
+    bounds the memory for networks with a large determinization blow-up.
+    The scan states are the same as those of AnmlSimulator.
+    """
+    # default number of cached states, which is also the most states that
+    # fastsnap.py lets the complete DFA of a bucket have
+    maxStates = 4096
+
+    def __init__(self, anmlFile, maxStates = None):
+        """
+        Constructor. Reads the ANML-NFA from the given file.
+        """
+        self._simulator = AnmlSimulator(anmlFile)
+        if self._simulator.numSpecials > 0:
+            raise SimulatorException, '\nUnable to determinize "%s" as it has counters or booleans.\n'%anmlFile
+        self._representatives, self._classes = self._simulator.symbol_classes()
+        self._maxStates = maxStates if maxStates is not None else self.maxStates
+        # number of transitions computed and number of times the cache was flushed
+        self.misses = 0
+        self.flushes = 0
+        self._flush()
+
+    def _flush(self):
+        self._stateIds = {}
+        self._stateMasks = []
+        self._transitions = []
+
+    def _add_state(self, enabled):
+        stateId = self._stateIds.get(enabled)
+        if stateId is None:
+            stateId = len(self._stateMasks)
+            self._stateIds[enabled] = stateId
+            self._stateMasks.append(enabled)
+            self._transitions.append([None] * len(self._representatives))
+        return stateId
+
+    def _transition(self, stateId, symbolClass):
+        """
+        Computes, and caches, the transition from the given state on a symbol class.
+        """
+        self.misses += 1
+        enabled = self._stateMasks[stateId]
+        matched, following = self._simulator.step(enabled, self._representatives[symbolClass])
+        if following not in self._stateIds and len(self._stateMasks) >= self._maxStates:
+            self.flushes += 1
+            self._flush()
+            stateId = self._add_state(enabled)
+        transition = (self._add_state(following), tuple(self._simulator.step_reports(matched)))
+        self._transitions[stateId][symbolClass] = transition
+        return transition
+
+    def flush(self):
+        """
+        Empties the cache of states, e.g. to measure a scan from a cold cache.
+        """
+        self._flush()
+
+    @property
+    def simulator(self):
+        return self._simulator
+
+    def suppress(self, components):
+        """
+        Suppresses the given components of the network, flushing the cached states.
+        """
+        self._simulator.suppress(components)
+        self._flush()
+
+    @property
+    def numStates(self):
+        return len(self._stateMasks)
+
+    def count_states(self, limit):
+        """
+        Returns the number of states of the complete DFA, or None if there are
+        more than the given number of states.
+        """
+        dfa = self.determinize(limit)
+        return len(dfa[2]) if dfa is not None else None
+
+    def determinize(self, limit):
+        """
+        Returns the complete DFA as (class of every symbol, state following the
+        first symbol of every class, following states of every state per class),
+        with the idle state as state 0, or None if there are more than the given
+        number of states.
+        """
+        stateIds = {0 : 0}
+        table = [None]
+        queue = deque()
+        def add(enabled):
+            stateId = stateIds.get(enabled)
+            if stateId is None:
+                if len(table) >= limit:
+                    return None
+                stateId = stateIds[enabled] = len(table)
+                table.append(None)
+                queue.append(enabled)
+            return stateId
+        # the states following the first symbol differ due to the start-of-data STEs
+        first = [add(self._simulator.step(0, symbol, True)[1]) for symbol in self._representatives]
+        if None in first:
+            return None
+        queue.appendleft(0)
+        while queue:
+            enabled = queue.popleft()
+            following = [add(self._simulator.step(enabled, symbol)[1]) for symbol in self._representatives]
+            if None in following:
+                return None
+            table[stateIds[enabled]] = following
+        return list(self._classes), first, table
+
+    @staticmethod
+    def product(dfa, other, limit):
+        """
+        Returns the DFA of the union of the networks of two DFAs returned by
+        determinize(), whose states are the reachable pairs of their states, or
+        None if there are more than the given number of states.
+        """
+        classes, first, table = dfa
+        otherClasses, otherFirst, otherTable = other
+        # the classes of the product are the pairs of the classes of every symbol
+        pairClasses = {}
+        productClasses = [pairClasses.setdefault((c, o), len(pairClasses)) for c, o in zip(classes, otherClasses)]
+        pairs = sorted(pairClasses, key = pairClasses.get)
+        stateIds = {(0, 0) : 0}
+        productTable = [None]
+        queue = deque([(0, 0)])
+        def add(pair):
+            stateId = stateIds.get(pair)
+            if stateId is None:
+                if len(productTable) >= limit:
+                    return None
+                stateId = stateIds[pair] = len(productTable)
+                productTable.append(None)
+                queue.append(pair)
+            return stateId
+        productFirst = [add((first[c], otherFirst[o])) for c, o in pairs]
+        if None in productFirst:
+            return None
+        while queue:
+            state, otherState = queue.popleft()
+            following = [add((table[state][c], otherTable[otherState][o])) for c, o in pairs]
+            if None in following:
+                return None
+            productTable[stateIds[(state, otherState)]] = following
+        return productClasses, productFirst, productTable
+
+    def scan(self, data, state = None, final = True):
+        """
+        Scans the given data starting from the given state.
+        Returns the list of (offset, report code) and the state after the scan.
+        """
+        if state is None:
+            state = self._simulator.initial_state()
+        offset = AnmlSimulator.state_offset(state)
+        enabled = 0
+        if isinstance(state, tuple):
+            enabled = state[1] if not isinstance(state[1], tuple) else AnmlSimulator._mask(state[1])
+        reports = []
+        position = 0
+        if offset == 0 and data:
+            # the start-of-data STEs are only enabled on the first symbol
+            matched, enabled = self._simulator.step(enabled, ord(data[0]), True)
+            reports.extend((0, reportCode) for reportCode in self._simulator.step_reports(matched))
+            position = 1
+        stateId = self._add_state(enabled)
+        classes = self._classes
+        for position in xrange(position, len(data)):
+            symbolClass = classes[ord(data[position])]
+            transition = self._transitions[stateId][symbolClass]
+            if transition is None:
+                transition = self._transition(stateId, symbolClass)
+            stateId, stateReports = transition
+            for reportCode in stateReports:
+                reports.append((offset + position, reportCode))
+        offset += len(data)
+        return reports, self._simulator.compact_state(offset, self._stateMasks[stateId], ())
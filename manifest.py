@@ -0,0 +1,170 @@
+#!/usr/bin/env python
+
+##
+# @file manifest.py
+# @brief Manifest of the buckets written by fastsnap.py.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from argparse import ArgumentParser
+import exceptions
+import hashlib
+import json
+import os
+import struct
+
+
+class ManifestException(exceptions.Exception):
+    pass
+
+
+class Manifest(object):
+    """
+    Class for writing and reading the manifest of the buckets of a run.
+
+    The JSON file describes every bucket: the keyword it scans and whether the
+    buffer is raw, its backend, its resources, i.e. the STEs, counters and
+    booleans of its rules and its clock divisor, the SIDs of its rules and of
+    those approximated in it, the start symbols used by its prefilter and the
+    hashes of its ANML and AP-FSM files. The rules verified on the host are
+    listed per keyword, and the patterns of all the rules are kept per keyword
+    as given to the automata, i.e. before any approximation.
+
+    The binary index maps every SID to its buckets without parsing the JSON:
+    a header with the number of buckets and entries, the bucket names, each
+    prefixed by its length, and the (SID, bucket index) entries sorted by SID.
+    """
+    fileName = 'manifest.json'
+    indexFileName = 'manifest.idx'
+
+    _magic = 'SNAPMIDX\x01'
+    _header = struct.Struct('<9sII')
+    _name = struct.Struct('<H')
+    _entry = struct.Struct('<IH')
+
+    @staticmethod
+    def file_hash(path):
+        """
+        Returns the SHA-1 of the given file, or None if it does not exist.
+        """
+        if not os.path.exists(path):
+            return None
+        with open(path, 'rb') as hashed:
+            return hashlib.sha1(hashed.read()).hexdigest()
+
+    @staticmethod
+    def symbols(symbols):
+        """
+        Returns the hexadecimal string of the given symbols.
+        """
+        return ''.join(chr(symbol) for symbol in sorted(symbols)).encode('hex')
+
+    @classmethod
+    def write(cls, directory, buckets, verified, rules = None):
+        """
+        Writes the manifest and the index of the given bucket descriptions,
+        rules verified on the host and patterns of the rules to the directory.
+        """
+        with open(os.path.join(directory, cls.fileName), 'wb') as manifestFile:
+            json.dump({'buckets' : buckets, 'verify' : verified, 'rules' : rules or {}}, manifestFile,
+                      indent = 1, sort_keys = True)
+        names = sorted(buckets.iterkeys())
+        entries = sorted((sid, index) for index, name in enumerate(names) for sid in buckets[name]['sids'])
+        with open(os.path.join(directory, cls.indexFileName), 'wb') as indexFile:
+            indexFile.write(cls._header.pack(cls._magic, len(names), len(entries)))
+            for name in names:
+                indexFile.write(cls._name.pack(len(name)) + name)
+            indexFile.write(''.join(cls._entry.pack(sid, index) for sid, index in entries))
+
+    def __init__(self, directory):
+        """
+        Constructor. Reads the manifest and the index from the given directory.
+        """
+        with open(os.path.join(directory, self.fileName), 'rb') as manifestFile:
+            manifest = json.load(manifestFile)
+        self.buckets = dict((str(bucket), description) for bucket, description in manifest['buckets'].iteritems())
+        self.verified = dict((str(keyword), sids) for keyword, sids in manifest['verify'].iteritems())
+        self.rules = dict((str(keyword), rules) for keyword, rules in manifest.get('rules', {}).iteritems())
+        with open(os.path.join(directory, self.indexFileName), 'rb') as indexFile:
+            index = indexFile.read()
+        magic, numBuckets, numEntries = self._header.unpack_from(index, 0)
+        if magic != self._magic:
+            raise ManifestException, '\nFile "%s" is not a manifest index.\n'%self.indexFileName
+        offset = self._header.size
+        self._names = []
+        for b in xrange(numBuckets):
+            length = self._name.unpack_from(index, offset)[0]
+            offset += self._name.size
+            self._names.append(index[offset:offset + length])
+            offset += length
+        self._index = index
+        self._entries = offset
+        self._numEntries = numEntries
+
+    def _entry_sid(self, position):
+        return self._entry.unpack_from(self._index, self._entries + position * self._entry.size)[0]
+
+    def buckets_of(self, sid):
+        """
+        Returns the buckets with the rule of the given SID, using the index.
+        """
+        # binary search over the entries in place
+        low, high = 0, self._numEntries
+        while low < high:
+            middle = (low + high) // 2
+            if self._entry_sid(middle) < sid:
+                low = middle + 1
+            else:
+                high = middle
+        buckets = []
+        while low < self._numEntries:
+            entrySid, index = self._entry.unpack_from(self._index, self._entries + low * self._entry.size)
+            if entrySid != sid:
+                break
+            buckets.append(self._names[index])
+            low += 1
+        return buckets
+
+    def changed(self, directory):
+        """
+        Returns the buckets whose ANML file in the given directory no longer
+        matches the hash in the manifest.
+        """
+        return sorted(bucket for bucket, description in self.buckets.iteritems()
+                      if self.file_hash(os.path.join(directory, bucket + '.anml')) != description['anml_sha1'])
+
+
+if __name__ == '__main__':
+    parser = ArgumentParser(description = 'Summarize the manifest of the buckets written by fastsnap.py.')
+    parser.add_argument('directory', help = 'the directory with the generated buckets')
+    parser.add_argument('-s', '--sid', help = 'print the buckets of the rule with the given SID',
+                        type = int, metavar = 'SID')
+    args = parser.parse_args()
+
+    manifest = Manifest(args.directory)
+    if args.sid is not None:
+        buckets = manifest.buckets_of(args.sid)
+        verified = sorted(keyword for keyword, sids in manifest.verified.iteritems() if args.sid in sids)
+        print '%d: %s'%(args.sid, ' '.join(buckets + ['host:%s'%keyword for keyword in verified]) or 'not found')
+    else:
+        print '%-28s %-14s %4s %-5s %8s %8s %8s %7s %6s'%('bucket', 'keyword', 'raw', 'back', 'stes', 'counters',
+                                                        'booleans', 'divisor', 'sids')
+        for bucket in sorted(manifest.buckets):
+            b = manifest.buckets[bucket]
+            print '%-28s %-14s %4s %-5s %8d %8d %8d %7d %6d'%(bucket, b['keyword'], 'yes' if b['raw'] else 'no',
+                  b['backend'], b['stes'], b['counters'], b['booleans'], b['clock_divisor'], len(b['sids']))
+        changed = manifest.changed(args.directory)
+        if changed:
+            print 'Changed since the manifest was written: %s'%' '.join(changed)
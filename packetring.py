@@ -0,0 +1,450 @@
+#!/usr/bin/env python
+
+##
+# @file packetring.py
+# @brief Shared-memory rings for passing the captured frames to the scan processes.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from argparse import ArgumentParser
+import ctypes
+import ctypes.util
+import exceptions
+import mmap
+from multiprocessing import Process, Queue
+from multiprocessing.connection import Client, Listener
+from multiprocessing.reduction import recv_handle, send_handle
+import os
+import socket
+import struct
+import time
+
+from pcapreader import PcapReader, decode_packet
+from scanengine import ScanEngine
+from snapruntime import CpuList, FlowScanner, RssHash, open_alert_log, set_affinity
+
+
+class RingException(exceptions.Exception):
+    pass
+
+
+def huge_page_size():
+    """
+    Returns the default size of the huge pages in bytes.
+    """
+    with open('/proc/meminfo', 'rb') as memInfo:
+        for line in memInfo:
+            if line.startswith('Hugepagesize:'):
+                return int(line.split()[1]) << 10
+    raise RingException, '\nHuge pages are not supported.\n'
+
+
+def memfd_create(name, hugepages = False):
+    """
+    Creates an anonymous file in memory, backed by huge pages if requested.
+    Returns its descriptor.
+    """
+    libc = ctypes.CDLL(ctypes.util.find_library('c'), use_errno = True)
+    if not hasattr(libc, 'memfd_create'):
+        raise RingException, '\nmemfd_create is not provided by the C library.\n'
+    # MFD_CLOEXEC | MFD_HUGETLB
+    fd = libc.memfd_create(name, 0x0001 | (0x0004 if hugepages else 0))
+    if fd < 0:
+        errno = ctypes.get_errno()
+        raise RingException, '\nUnable to create the ring memory: %s\n'%os.strerror(errno)
+    return fd
+
+
+class PacketRing(object):
+    """
+    Class for a single producer, single consumer ring of frames in shared memory.
+
+    The first page of the memory holds the header: the capacity and link type,
+    followed by the head, written only by the producer, and the tail, written
+    only by the consumer, on separate cache lines. Both are byte counters which
+    only increase. Every record is a 16-byte header with the length of the frame
+    and its timestamp, followed by the frame, and is aligned to 16 bytes. A
+    record which does not fit before the end of the memory is preceded by a wrap
+    record. The frame is written before the head is advanced past it; the stores
+    are not reordered on x86, which this relies on.
+
+    The consumer reads every frame in place and releases it only after it has
+    been processed, so a frame is copied once, by the producer.
+    """
+    _magic = 'SNAPRING'
+    _header = struct.Struct('<8sQI')
+    _counter = struct.Struct('<Q')
+    _record = struct.Struct('<IId')
+    _headOffset = 64
+    _tailOffset = 128
+    _dataOffset = 4096
+    _wrap = 0xffffffff
+    _end = 0xfffffffe
+
+    # returned by read when the producer has finished
+    END = 'end'
+
+    def __init__(self, fd, size = None, linkType = PcapReader.LINKTYPE_ETHERNET):
+        """
+        Constructor. Initializes a ring of the given size, including the header,
+        in the memory of the given descriptor if the size is given, or maps the
+        ring already initialized in it.
+        """
+        initialize = size is not None
+        if initialize:
+            if size % 4096 or size <= self._dataOffset:
+                raise RingException, '\nThe ring size must be a multiple of the page size.\n'
+            os.ftruncate(fd, size)
+        size = os.fstat(fd).st_size
+        self._memory = mmap.mmap(fd, size, mmap.MAP_SHARED, mmap.PROT_READ | mmap.PROT_WRITE)
+        if initialize:
+            self._header.pack_into(self._memory, 0, self._magic, size - self._dataOffset, linkType)
+        magic, self.capacity, self.linkType = self._header.unpack_from(self._memory, 0)
+        if magic != self._magic or self._dataOffset + self.capacity != size:
+            raise RingException, '\nThe shared memory does not hold a packet ring.\n'
+        # the producer and the consumer each keep a copy of the counter they write
+        self._head = self._counter.unpack_from(self._memory, self._headOffset)[0]
+        self._tail = self._counter.unpack_from(self._memory, self._tailOffset)[0]
+        self._pending = 0
+
+    def close(self):
+        self._memory.close()
+
+    def _put(self, length, timestamp, frame, wait):
+        size = self._record.size + ((len(frame) + 15) & ~15)
+        position = self._head % self.capacity
+        padding = self.capacity - position if self.capacity - position < size else 0
+        if padding + size > self.capacity:
+            raise RingException, '\nFrame of %d bytes does not fit in the ring.\n'%len(frame)
+        while self._head + padding + size - self._counter.unpack_from(self._memory, self._tailOffset)[0] > self.capacity:
+            if not wait:
+                return False
+            time.sleep(0)
+        if padding:
+            self._record.pack_into(self._memory, self._dataOffset + position, self._wrap, 0, 0.0)
+            position = 0
+        self._record.pack_into(self._memory, self._dataOffset + position, length, 0, timestamp)
+        start = self._dataOffset + position + self._record.size
+        self._memory[start:start + len(frame)] = frame
+        self._head += padding + size
+        self._counter.pack_into(self._memory, self._headOffset, self._head)
+        return True
+
+    def write(self, timestamp, frame, wait = True):
+        """
+        Writes a frame to the ring, waiting for the space to be released if required.
+        Returns False if the ring is full and waiting is not allowed.
+        """
+        return self._put(len(frame), timestamp, frame, wait)
+
+    def finish(self):
+        """
+        Signals the consumer that no more frames will be written.
+        """
+        self._put(self._end, 0.0, '', True)
+
+    def read(self):
+        """
+        Returns the timestamp of the next frame and a buffer over the frame in
+        the ring, END if the producer has finished, or None if the ring is empty.
+        The previously read frame is released.
+        """
+        self.release()
+        while True:
+            if self._tail == self._counter.unpack_from(self._memory, self._headOffset)[0]:
+                return None
+            position = self._tail % self.capacity
+            length, reserved, timestamp = self._record.unpack_from(self._memory, self._dataOffset + position)
+            if length == self._wrap:
+                self._tail += self.capacity - position
+                continue
+            if length == self._end:
+                return self.END
+            self._pending = self._record.size + ((length + 15) & ~15)
+            return timestamp, buffer(self._memory, self._dataOffset + position + self._record.size, length)
+
+    def release(self):
+        """
+        Releases the last frame read so that its space can be reused by the producer.
+        """
+        if self._pending:
+            self._tail += self._pending
+            self._pending = 0
+            self._counter.pack_into(self._memory, self._tailOffset, self._tail)
+
+    def frames(self):
+        """
+        Yields the frames of the ring until the producer finishes, waiting for them if required.
+        """
+        while True:
+            frame = self.read()
+            if frame is self.END:
+                self.release()
+                return
+            if frame is None:
+                time.sleep(0)
+                continue
+            yield frame
+
+
+class RingServer(object):
+    """
+    Class for creating the rings in the capture process and passing their
+    descriptors over a Unix socket to the scan processes which connect to it.
+    The rings are handed out in the order in which the consumers connect; a
+    connection may also only ask for the number of rings.
+
+    The size of a ring backed by huge pages is rounded up to a multiple of the
+    huge page size. If the huge pages cannot be allocated, e.g. as none are
+    reserved, the ring is backed by normal pages.
+    """
+    def __init__(self, address, rings, size, linkType, hugepages = False):
+        self.rings = []
+        self._fds = []
+        for index in xrange(rings):
+            fd, ring = self._create('snapring.%d'%index, size, linkType, hugepages)
+            self._fds.append(fd)
+            self.rings.append(ring)
+        self._listener = Listener(address, 'AF_UNIX')
+
+    @staticmethod
+    def _create(name, size, linkType, hugepages):
+        if hugepages:
+            fd = None
+            try:
+                pageSize = huge_page_size()
+                fd = memfd_create(name, True)
+                return fd, PacketRing(fd, (size + pageSize - 1) // pageSize * pageSize, linkType)
+            except (RingException, EnvironmentError):
+                if fd is not None:
+                    os.close(fd)
+        fd = memfd_create(name)
+        return fd, PacketRing(fd, size, linkType)
+
+    def accept(self):
+        """
+        Waits for a consumer to connect to every ring.
+        """
+        index = 0
+        while index < len(self._fds):
+            connection = self._listener.accept()
+            pid = connection.recv()
+            if pid is None:
+                connection.send(len(self._fds))
+            else:
+                connection.send(index)
+                send_handle(connection, self._fds[index], pid)
+                index += 1
+            connection.close()
+
+    def close(self):
+        self._listener.close()
+        for ring in self.rings:
+            ring.close()
+        for fd in self._fds:
+            os.close(fd)
+
+
+def _connect(address):
+    # the capture process may not be listening yet
+    for attempt in xrange(100):
+        try:
+            return Client(address, 'AF_UNIX')
+        except socket.error:
+            time.sleep(0.1)
+    raise RingException, '\nUnable to connect to the ring server at "%s".\n'%address
+
+
+def ring_count(address):
+    """
+    Returns the number of rings served at the given address.
+    """
+    connection = _connect(address)
+    try:
+        connection.send(None)
+        return connection.recv()
+    finally:
+        connection.close()
+
+
+def connect_ring(address):
+    """
+    Connects to the server at the given address and maps the ring it hands out.
+    Returns the index of the ring and the ring.
+    """
+    connection = _connect(address)
+    connection.send(os.getpid())
+    index = connection.recv()
+    fd = recv_handle(connection)
+    connection.close()
+    try:
+        return index, PacketRing(fd)
+    finally:
+        os.close(fd)
+
+
+def replay(pcapFile, server):
+    """
+    Writes the decodable frames of a capture to the ring of their flow.
+    Returns the number of frames and bytes written and the number of times the
+    producer found a ring full.
+    """
+    rss = RssHash()
+    rings = server.rings
+    frames = 0
+    size = 0
+    full = 0
+    with PcapReader(pcapFile) as reader:
+        for timestamp, frame in reader:
+            packet = decode_packet(timestamp, frame, reader.linkType)
+            if packet is None:
+                continue
+            ring = rings[rss(packet) % len(rings)]
+            if not ring.write(timestamp, frame, False):
+                full += 1
+                ring.write(timestamp, frame)
+            frames += 1
+            size += len(frame)
+    for ring in rings:
+        ring.finish()
+    return frames, size, full
+
+
+def _run_ring_worker(address, directory, results, cpu, stream, aggregate, prefilter, logDirectory, binary):
+    """
+    Scans the frames of the ring handed out by the server until the producer finishes.
+    """
+    try:
+        if cpu is not None:
+            set_affinity([cpu])
+        engine = ScanEngine(directory, prefilter = prefilter)
+        index, ring = connect_ring(address)
+    except Exception, e:
+        results.put((None, '%s: %s'%(type(e).__name__, e)))
+        return
+    log = open_alert_log(logDirectory, index, binary)
+    scanner = FlowScanner(engine, log if log is not None else lambda *alert : None, stream, aggregate)
+    busy = 0.0
+    for timestamp, frame in ring.frames():
+        t = time.time()
+        # only the payload is copied out of the ring
+        packet = decode_packet(timestamp, frame, ring.linkType)
+        if packet is not None:
+            scanner.process(packet)
+        busy += time.time() - t
+    t = time.time()
+    scanner.close()
+    busy += time.time() - t
+    dropped = 0
+    if log is not None:
+        log.close()
+        dropped = getattr(log, 'dropped', 0)
+    ring.close()
+    results.put((index, {'packets' : scanner.packets, 'bytes' : scanner.bytes, 'alerts' : scanner.alerts, 'busy' : busy,
+                         'dropped' : dropped}))
+
+
+def scan(address, directory, workers, cpus = None, stream = False, prefilter = False, logDirectory = None,
+         binary = False, aggregate = None):
+    """
+    Scans the frames of the rings served at the given address on one worker
+    process per ring, by default as many as there are rings.
+    Returns the counters of every worker.
+    """
+    rings = ring_count(address)
+    if workers is None:
+        workers = rings
+    if workers != rings:
+        # the workers without a ring would wait for one forever, while the server
+        # waits forever for a consumer of every ring
+        raise RingException, '\n%d workers requested for %d rings; every ring needs exactly one worker.\n'%(workers, rings)
+    results = Queue()
+    processes = []
+    for w in xrange(workers):
+        cpu = cpus[w % len(cpus)] if cpus else None
+        process = Process(target = _run_ring_worker, args = (address, directory, results, cpu, stream, aggregate,
+                                                             prefilter, logDirectory, binary))
+        process.start()
+        processes.append(process)
+    counters = [None] * workers
+    errors = []
+    for w in xrange(workers):
+        index, workerCounters = results.get()
+        if index is None:
+            errors.append(workerCounters)
+        else:
+            counters[index] = workerCounters
+    for process in processes:
+        process.join()
+    if errors:
+        raise RuntimeError, 'Unable to scan the rings.\n%s'%'\n'.join(errors)
+    return counters
+
+
+if __name__ == '__main__':
+    parser = ArgumentParser(description = 'Pass the captured frames to the scan processes through shared-memory rings.')
+    subparsers = parser.add_subparsers(dest = 'command')
+    replayParser = subparsers.add_parser('replay', help = 'replay a pcap capture into the rings')
+    replayParser.add_argument('pcap', help = 'the pcap capture to be replayed')
+    replayParser.add_argument('address', help = 'path of the Unix socket over which the rings are passed')
+    replayParser.add_argument('-r', '--rings', help = 'number of rings, one per scan worker',
+                              type = int, default = 1, metavar = 'N')
+    replayParser.add_argument('-m', '--memory', help = 'size of the memory of every ring in MB',
+                              type = int, default = 64, metavar = 'MB')
+    replayParser.add_argument('--hugepages', help = 'back the rings with huge pages',
+                              action = 'store_true')
+    scanParser = subparsers.add_parser('scan', help = 'scan the frames of the rings')
+    scanParser.add_argument('directory', help = 'the directory with the generated buckets')
+    scanParser.add_argument('address', help = 'path of the Unix socket over which the rings are passed')
+    scanParser.add_argument('-w', '--workers', help = 'number of worker processes, one per ring, as many as the rings by default',
+                            type = int, metavar = 'N')
+    scanParser.add_argument('-p', '--pin', help = 'CPUs to which the workers are pinned, e.g. 0-7,16-23',
+                            type = CpuList, metavar = 'CPUS')
+    scanParser.add_argument('-s', '--stream', help = 'scan the packets of every flow direction as a stream',
+                            action = 'store_true')
+    scanParser.add_argument('-a', '--aggregate', help = 'raise one alert per SID per buffer or stream, at its first or last match',
+                            choices = ('first', 'last'))
+    scanParser.add_argument('-f', '--prefilter', help = 'skip the buckets which cannot match a buffer',
+                            action = 'store_true')
+    scanParser.add_argument('-l', '--log', help = 'directory to which the alerts are logged by every worker',
+                            metavar = 'DIR')
+    scanParser.add_argument('-b', '--binary', help = 'log the alerts in the binary format, off the scanning thread',
+                            action = 'store_true')
+    args = parser.parse_args()
+
+    if args.command == 'replay':
+        with PcapReader(args.pcap) as reader:
+            linkType = reader.linkType
+        server = RingServer(args.address, args.rings, args.memory << 20, linkType, args.hugepages)
+        try:
+            server.accept()
+            t = time.time()
+            frames, size, full = replay(args.pcap, server)
+            t = time.time() - t
+        finally:
+            server.close()
+        print 'Replayed %d frames, %d bytes in %.3f s, %.3f MB/s; rings found full %d times'%(frames, size, t,
+              size / (t * 1e6) if t > 0 else 0.0, full)
+    else:
+        if args.log is not None and not os.path.exists(args.log):
+            os.makedirs(args.log)
+        t = time.time()
+        counters = scan(args.address, args.directory, args.workers, args.pin, args.stream, args.prefilter, args.log,
+                        args.binary, args.aggregate)
+        t = time.time() - t
+        for index, c in enumerate(counters):
+            print 'worker %d: %d packets, %d bytes, %d alerts, %d dropped, %.3f s busy'%(index, c['packets'], c['bytes'],
+                  c['alerts'], c['dropped'], c['busy'])
+        print 'Total time taken in scanning: %.3f s'%t
@@ -0,0 +1,159 @@
+##
+# @file parallelscanner.py
+# @brief Speculative data-parallel scanning of a single large buffer.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from argparse import ArgumentParser
+from multiprocessing import Pool
+import sys
+import time
+
+from anmlsimulator import AnmlSimulator
+
+
+# simulators used by the worker processes, loaded on first use, by ANML file
+_workerSimulators = {}
+
+def _scan_chunk(args):
+    """
+    Scans a chunk, in a worker process, from the speculated start state.
+    The speculated state is obtained by scanning a few bytes preceding the chunk
+    from an empty state. The states at regular checkpoints are recorded so that
+    the fix-up pass can detect where the speculation converges.
+    """
+    anmlFile, lookback, chunk, offset, checkpoint, final = args
+    simulator = _workerSimulators.get(anmlFile)
+    if simulator is None:
+        simulator = _workerSimulators[anmlFile] = AnmlSimulator(anmlFile)
+    state = simulator.initial_state(offset - len(lookback))
+    if lookback:
+        state = simulator.scan(lookback, state, False)[1]
+    reports = []
+    checkpoints = []
+    for start in xrange(0, len(chunk), checkpoint):
+        checkpoints.append(state)
+        end = min(start + checkpoint, len(chunk))
+        segmentReports, state = simulator.scan(chunk[start:end], state, final and end == len(chunk))
+        reports.extend(segmentReports)
+    return reports, checkpoints, state
+
+
+class ParallelScanner(object):
+    """
+    Class for scanning a large buffer, e.g. file_data or http_client_body of a
+    big download, on multiple cores.
+
+    The buffer is split into chunks which are scanned concurrently, each from a
+    speculated start state. A sequential fix-up pass then rescans every chunk
+    from the true state, left to right, only until the true state converges
+    with the speculated one at a checkpoint; the speculative reports after that
+    point are exact. Worker processes are used in place of threads so that the
+    chunks do not serialize on the interpreter lock; they are shared by all the
+    buckets and load the network of a bucket when they first scan it.
+    """
+    def __init__(self, workers, chunkSize = 1 << 20, checkpoint = 4096, lookback = 64):
+        """
+        Constructor. Starts the given number of worker processes.
+        """
+        self._workers = workers
+        self._chunkSize = chunkSize
+        self._checkpoint = checkpoint
+        self._lookback = lookback
+        self._pool = Pool(workers)
+        # number of bytes rescanned in the fix-up passes
+        self.fixupBytes = 0
+
+    def close(self):
+        self._pool.close()
+        self._pool.join()
+
+    def _chunks(self, length):
+        # at least one chunk per worker, if the buffer is large enough
+        chunkSize = max(min(self._chunkSize, (length + self._workers - 1) // self._workers), self._checkpoint)
+        return [(start, min(start + chunkSize, length)) for start in xrange(0, length, chunkSize)]
+
+    def _fixup(self, simulator, chunk, speculated, state, final):
+        """
+        Rescans the chunk from the true state until it converges with the speculated
+        run at a checkpoint. Returns the exact reports and the end state of the chunk.
+        """
+        specReports, checkpoints, specState = speculated
+        reports = []
+        for index in xrange(len(checkpoints)):
+            if AnmlSimulator.same_configuration(state, checkpoints[index]):
+                offset = AnmlSimulator.state_offset(checkpoints[index])
+                reports.extend(r for r in specReports if r[0] >= offset)
+                return reports, specState
+            start = index * self._checkpoint
+            end = min(start + self._checkpoint, len(chunk))
+            segmentReports, state = simulator.scan(chunk[start:end], state, final and end == len(chunk))
+            reports.extend(segmentReports)
+            self.fixupBytes += end - start
+        return reports, state
+
+    def scan(self, anmlFile, simulator, data, state = None, final = True):
+        """
+        Scans the given data starting from the given state with the simulator
+        of the given ANML file, whose network the workers load from the file.
+        Returns the same reports and the state as AnmlSimulator.scan.
+        """
+        if state is None:
+            state = simulator.initial_state()
+        chunks = self._chunks(len(data))
+        if len(chunks) <= 1:
+            return simulator.scan(data, state, final)
+        baseOffset = AnmlSimulator.state_offset(state)
+        tasks = []
+        for start, end in chunks[1:]:
+            lookback = data[max(start - self._lookback, 0):start]
+            tasks.append((anmlFile, lookback, data[start:end], baseOffset + start, self._checkpoint,
+                          final and end == len(data)))
+        pending = self._pool.map_async(_scan_chunk, tasks)
+        # the first chunk starts from a known state, so scan it while the others are speculated
+        start, end = chunks[0]
+        reports, state = simulator.scan(data[start:end], state, False)
+        for (start, end), speculated in zip(chunks[1:], pending.get()):
+            chunkReports, state = self._fixup(simulator, data[start:end], speculated, state, final and end == len(data))
+            reports.extend(chunkReports)
+        return reports, state
+
+
+if __name__ == '__main__':
+    parser = ArgumentParser(description = 'Check that the parallel scan of a file reports what the sequential scan does.')
+    parser.add_argument('anml', help = 'the ANML file of the bucket')
+    parser.add_argument('data', help = 'the file to be scanned as one buffer')
+    parser.add_argument('-w', '--workers', help = 'number of worker processes',
+                        type = int, default = 4, metavar = 'N')
+    parser.add_argument('-k', '--chunk', help = 'maximum size of a chunk in bytes',
+                        type = int, default = 1 << 20, metavar = 'B')
+    args = parser.parse_args()
+
+    simulator = AnmlSimulator(args.anml)
+    with open(args.data, 'rb') as dataFile:
+        data = dataFile.read()
+    t1 = time.time()
+    expected, expectedState = simulator.scan(data)
+    t1 = time.time() - t1
+    scanner = ParallelScanner(args.workers, args.chunk)
+    t2 = time.time()
+    reports, state = scanner.scan(args.anml, simulator, data)
+    t2 = time.time() - t2
+    scanner.close()
+    print 'Sequential: %d reports in %.3f s; parallel: %d reports in %.3f s, %d bytes fixed up'%(len(expected), t1,
+          len(reports), t2, scanner.fixupBytes)
+    if reports != expected or not AnmlSimulator.same_configuration(state, expectedState):
+        print 'The parallel scan differs from the sequential scan.'
+        sys.exit(1)
@@ -0,0 +1,230 @@
+##
+# @file pcapreader.py
+# @brief Reading and writing of pcap captures and decoding of IPv4 TCP/UDP packets.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import exceptions
+import struct
+
+
+class PcapException(exceptions.Exception):
+    pass
+
+
+class Packet(object):
+    """
+    Class for storing the fields of a decoded packet which are used for scanning.
+    The addresses are stored as packed 4-byte strings.
+    """
+    __slots__ = ('timestamp', 'protocol', 'srcAddr', 'srcPort', 'dstAddr', 'dstPort', 'flags', 'payload')
+
+    # protocol numbers and TCP flags
+    TCP = 6
+    UDP = 17
+    FIN = 0x01
+    SYN = 0x02
+    RST = 0x04
+
+    def __init__(self, timestamp, protocol, srcAddr, srcPort, dstAddr, dstPort, flags, payload):
+        self.timestamp = timestamp
+        self.protocol = protocol
+        self.srcAddr = srcAddr
+        self.srcPort = srcPort
+        self.dstAddr = dstAddr
+        self.dstPort = dstPort
+        self.flags = flags
+        self.payload = payload
+
+    def __getstate__(self):
+        return tuple(getattr(self, name) for name in self.__slots__)
+
+    def __setstate__(self, state):
+        for name, value in zip(self.__slots__, state):
+            setattr(self, name, value)
+
+    @property
+    def closing(self):
+        return self.protocol == self.TCP and bool(self.flags & (self.FIN | self.RST))
+
+
+class PcapReader(object):
+    """
+    Class for reading the frames from a capture in the classic pcap format,
+    with either byte order and either microsecond or nanosecond timestamps.
+    """
+    # link types which can be decoded
+    LINKTYPE_NULL = 0
+    LINKTYPE_ETHERNET = 1
+    LINKTYPE_RAW = 101
+    LINKTYPE_LINUX_SLL = 113
+    LINKTYPE_IPV4 = 228
+
+    _magics = {
+        0xa1b2c3d4 : 1e-6,
+        0xa1b23c4d : 1e-9,
+    }
+
+    def __init__(self, pcapFile):
+        """
+        Constructor. Reads the global header of the given file.
+        """
+        self._file = open(pcapFile, 'rb')
+        header = self._file.read(24)
+        if len(header) < 24:
+            raise PcapException, '\nFile "%s" is too short for a pcap capture.\n'%pcapFile
+        for byteOrder in ('<', '>'):
+            magic = struct.unpack(byteOrder + 'I', header[:4])[0]
+            if magic in self._magics:
+                self._resolution = self._magics[magic]
+                break
+        else:
+            raise PcapException, '\nFile "%s" is not a pcap capture.\n'%pcapFile
+        self._recordHeader = struct.Struct(byteOrder + 'IIII')
+        self.snapLength, self.linkType = struct.unpack(byteOrder + 'II', header[16:24])
+
+    def close(self):
+        self._file.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def __iter__(self):
+        """
+        Yields the timestamp and the captured bytes of every frame.
+        """
+        recordHeader = self._recordHeader
+        while True:
+            header = self._file.read(recordHeader.size)
+            if len(header) < recordHeader.size:
+                return
+            seconds, fraction, capturedLength, length = recordHeader.unpack(header)
+            frame = self._file.read(capturedLength)
+            if len(frame) < capturedLength:
+                return
+            yield seconds + fraction * self._resolution, frame
+
+    def packets(self):
+        """
+        Yields the decoded IPv4 TCP/UDP packets of the capture.
+        """
+        for timestamp, frame in self:
+            packet = decode_packet(timestamp, frame, self.linkType)
+            if packet is not None:
+                yield packet
+
+
+class PcapWriter(object):
+    """
+    Class for writing packets to a capture in the classic pcap format, as raw
+    IPv4 frames with microsecond timestamps.
+    """
+    def __init__(self, pcapFile, snapLength = 65535):
+        self._file = open(pcapFile, 'wb')
+        self._file.write(struct.pack('<IHHiIII', 0xa1b2c3d4, 2, 4, 0, 0, snapLength, PcapReader.LINKTYPE_RAW))
+        self._recordHeader = struct.Struct('<IIII')
+
+    def close(self):
+        self._file.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def write(self, packet, sequence = 0):
+        """
+        Writes the given packet, with the given TCP sequence number.
+        """
+        frame = encode_packet(packet, sequence)
+        seconds = int(packet.timestamp)
+        microseconds = int(round((packet.timestamp - seconds) * 1e6))
+        self._file.write(self._recordHeader.pack(seconds, microseconds, len(frame), len(frame)) + frame)
+
+
+_ethernetTypes = struct.Struct('!H')
+_ipv4Header = struct.Struct('!BBHHHBBH4s4s')
+_ports = struct.Struct('!HH')
+_tcpHeader = struct.Struct('!HHIIBBHHH')
+_udpHeader = struct.Struct('!HHHH')
+
+def _network_offset(frame, linkType):
+    """
+    Returns the offset of the IPv4 header in the given frame, or None.
+    """
+    if linkType in (PcapReader.LINKTYPE_RAW, PcapReader.LINKTYPE_IPV4):
+        return 0
+    if linkType == PcapReader.LINKTYPE_NULL:
+        return 4
+    if linkType == PcapReader.LINKTYPE_LINUX_SLL:
+        offset = 16
+    elif linkType == PcapReader.LINKTYPE_ETHERNET:
+        offset = 14
+    else:
+        return None
+    if len(frame) < offset:
+        return None
+    etherType = _ethernetTypes.unpack_from(frame, offset - 2)[0]
+    # skip the VLAN tags
+    while etherType in (0x8100, 0x88a8) and len(frame) >= offset + 4:
+        etherType = _ethernetTypes.unpack_from(frame, offset + 2)[0]
+        offset += 4
+    return offset if etherType == 0x0800 else None
+
+def decode_packet(timestamp, frame, linkType):
+    """
+    Decodes an IPv4 TCP/UDP packet from the given frame.
+    Returns None for any other frame and for the non-first IP fragments.
+    """
+    offset = _network_offset(frame, linkType)
+    if offset is None or len(frame) < offset + _ipv4Header.size:
+        return None
+    versionLength, tos, totalLength, ident, fragment, ttl, protocol, checksum, srcAddr, dstAddr = _ipv4Header.unpack_from(frame, offset)
+    if versionLength >> 4 != 4 or (fragment & 0x1fff) != 0:
+        return None
+    end = min(offset + totalLength, len(frame))
+    offset += (versionLength & 0x0f) * 4
+    if protocol == Packet.TCP:
+        if end < offset + 20:
+            return None
+        flags = ord(frame[offset + 13])
+        payloadOffset = offset + (ord(frame[offset + 12]) >> 4) * 4
+    elif protocol == Packet.UDP:
+        if end < offset + 8:
+            return None
+        flags = 0
+        payloadOffset = offset + 8
+    else:
+        return None
+    srcPort, dstPort = _ports.unpack_from(frame, offset)
+    return Packet(timestamp, protocol, srcAddr, srcPort, dstAddr, dstPort, flags, frame[payloadOffset:end])
+
+def encode_packet(packet, sequence = 0):
+    """
+    Encodes the given TCP/UDP packet as a raw IPv4 frame; the checksums are left zero.
+    """
+    if packet.protocol == Packet.TCP:
+        transport = _tcpHeader.pack(packet.srcPort, packet.dstPort, sequence, 0, 5 << 4, packet.flags, 65535, 0, 0)
+    elif packet.protocol == Packet.UDP:
+        transport = _udpHeader.pack(packet.srcPort, packet.dstPort, _udpHeader.size + len(packet.payload), 0)
+    else:
+        raise PcapException, '\nUnable to encode packet of protocol %d.\n'%packet.protocol
+    totalLength = _ipv4Header.size + len(transport) + len(packet.payload)
+    return _ipv4Header.pack(0x45, 0, totalLength, 0, 0, 64, packet.protocol, 0,
+                            packet.srcAddr, packet.dstAddr) + transport + packet.payload
@@ -0,0 +1,200 @@
+##
+# @file perfcounters.py
+# @brief Hardware performance counters of the scans read through perf_event_open.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import ctypes
+import ctypes.util
+import exceptions
+import fcntl
+import os
+import platform
+import struct
+
+
+class PerfException(exceptions.Exception):
+    pass
+
+
+class PerfCounters(object):
+    """
+    Class for counting the hardware events of the calling thread.
+
+    The events are opened as one group with perf_event_open, counting in user
+    space only, and stay enabled; a reading of the group is a single read of
+    the leader. The kernel multiplexes the group if the PMU cannot hold all
+    its events, so the difference of two readings is scaled by the fraction of
+    the time for which the group was actually counting. The events which the
+    CPU or the kernel does not provide, e.g. in a virtual machine, are left out.
+    """
+    # perf_event_open system call number per machine
+    _syscalls = {
+        'x86_64' : 298,
+        'aarch64' : 241,
+        'i686' : 336,
+        'i386' : 336,
+    }
+
+    # types of the events
+    _TYPE_HARDWARE = 0
+    _TYPE_HW_CACHE = 3
+
+    # (name, type, config) of the counted events; the cache events are the
+    # read misses, i.e. cache | read << 8 | miss << 16
+    events = (
+        ('cycles', _TYPE_HARDWARE, 0),
+        ('instructions', _TYPE_HARDWARE, 1),
+        ('l1d_misses', _TYPE_HW_CACHE, 0 | (0 << 8) | (1 << 16)),
+        ('llc_misses', _TYPE_HW_CACHE, 2 | (0 << 8) | (1 << 16)),
+        ('branch_misses', _TYPE_HARDWARE, 5),
+    )
+
+    # struct perf_event_attr of PERF_ATTR_SIZE_VER5
+    _attr = struct.Struct('<IIQQQQQIIQQQQIiQIHH')
+    # read_format: PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING | PERF_FORMAT_GROUP
+    _readFormat = 1 | 2 | 8
+    # flags: disabled for the leader, exclude_kernel and exclude_hv
+    _disabled = 1 << 0
+    _excludeKernel = 1 << 5
+    _excludeHv = 1 << 6
+
+    # ioctls, applied to the whole group
+    _IOC_ENABLE = 0x2400
+    _IOC_DISABLE = 0x2401
+    _IOC_FLAG_GROUP = 1
+
+    @classmethod
+    def _open(cls, eventType, config, groupFd, leader):
+        libc = ctypes.CDLL(ctypes.util.find_library('c'), use_errno = True)
+        number = cls._syscalls.get(platform.machine())
+        if number is None:
+            raise PerfException, '\nperf_event_open is not known on "%s".\n'%platform.machine()
+        flags = cls._excludeKernel | cls._excludeHv | (cls._disabled if leader else 0)
+        attr = ctypes.create_string_buffer(cls._attr.pack(eventType, cls._attr.size, config, 0, 0, cls._readFormat,
+                                                          flags, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0))
+        # the calling thread, on any CPU
+        fd = libc.syscall(number, attr, 0, -1, groupFd, 0)
+        if fd < 0:
+            return None, os.strerror(ctypes.get_errno())
+        return fd, None
+
+    def __init__(self, names = None):
+        """
+        Constructor. Opens and enables the given events, or all of them.
+        """
+        self.names = []
+        self.unavailable = []
+        self._fds = []
+        error = None
+        for name, eventType, config in self.events:
+            if names is not None and name not in names:
+                continue
+            fd, error = self._open(eventType, config, self._fds[0] if self._fds else -1, not self._fds)
+            if fd is None:
+                self.unavailable.append(name)
+                continue
+            self._fds.append(fd)
+            self.names.append(name)
+        if not self._fds:
+            raise PerfException, '\nUnable to open any hardware counter: %s\n'%error
+        self._values = struct.Struct('<%dQ'%(3 + len(self._fds)))
+        fcntl.ioctl(self._fds[0], self._IOC_ENABLE, self._IOC_FLAG_GROUP)
+
+    def read(self):
+        """
+        Returns a reading of the group: the time enabled, the time running and
+        the count of every event.
+        """
+        values = self._values.unpack(os.read(self._fds[0], self._values.size))
+        return values[1:]
+
+    def delta(self, first, second):
+        """
+        Returns the count of every event between the given readings, scaled
+        for the multiplexing of the group.
+        """
+        enabled = second[0] - first[0]
+        running = second[1] - first[1]
+        scale = float(enabled) / running if running > 0 else 0.0
+        return [(after - before) * scale for before, after in zip(first[2:], second[2:])]
+
+    def close(self):
+        fcntl.ioctl(self._fds[0], self._IOC_DISABLE, self._IOC_FLAG_GROUP)
+        for fd in self._fds:
+            os.close(fd)
+        self._fds = []
+
+
+class BucketCounters(object):
+    """
+    Class for accumulating the hardware events and the bytes scanned per bucket.
+    """
+    def __init__(self, counters):
+        self._counters = counters
+        self.names = counters.names
+        self.bytes = {}
+        self.totals = {}
+
+    def read(self):
+        return self._counters.read()
+
+    def add(self, bucket, numBytes, before):
+        """
+        Adds the events since the given reading to the scan of the given bytes by the bucket.
+        """
+        counts = self._counters.delta(before, self._counters.read())
+        totals = self.totals.get(bucket)
+        if totals is None:
+            totals = self.totals[bucket] = [0.0] * len(counts)
+            self.bytes[bucket] = 0
+        for i, count in enumerate(counts):
+            totals[i] += count
+        self.bytes[bucket] += numBytes
+
+    @staticmethod
+    def merge(summaries):
+        """
+        Returns the sum of the given summaries, e.g. of all the workers.
+        """
+        merged = {}
+        for summary in summaries:
+            for bucket, (numBytes, totals) in summary.iteritems():
+                previous = merged.get(bucket, (0, [0.0] * len(totals)))
+                merged[bucket] = (previous[0] + numBytes, [a + b for a, b in zip(previous[1], totals)])
+        return merged
+
+    def summary(self):
+        """
+        Returns the bytes and the totals of every bucket, which can be shipped to other processes.
+        """
+        return dict((bucket, (self.bytes[bucket], self.totals[bucket])) for bucket in self.totals)
+
+    @staticmethod
+    def per_byte(names, numBytes, totals):
+        """
+        Returns the events per scanned byte, with the instructions per cycle.
+        """
+        perByte = dict((name, count / max(numBytes, 1)) for name, count in zip(names, totals))
+        counts = dict(zip(names, totals))
+        if counts.get('cycles') and 'instructions' in counts:
+            perByte['ipc'] = counts['instructions'] / counts['cycles']
+        return perByte
+
+    @classmethod
+    def format(cls, names, numBytes, totals):
+        perByte = cls.per_byte(names, numBytes, totals)
+        return ', '.join('%s %.3f'%(name if name == 'ipc' else name + '/B', perByte[name])
+                         for name in names + ['ipc'] if name in perByte)
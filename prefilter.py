@@ -0,0 +1,51 @@
+##
+# @file prefilter.py
+# @brief First-byte prefilter for skipping the buffers which cannot match a bucket.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+
+class Prefilter(object):
+    """
+    Class for checking if a buffer can produce any report of a bucket.
+
+    Starting from an idle state, no STE is matched, and hence no report is
+    produced, until a symbol accepted by a start STE is seen. A buffer without
+    any such symbol can therefore be skipped. The check removes all the other
+    symbols from the buffer, which runs over the buffer as a single library call.
+    """
+    def __init__(self, starts, startOfData):
+        allSymbols = set(xrange(256))
+        self._others = ''.join(chr(symbol) for symbol in sorted(allSymbols.difference(starts)))
+        self._startOfData = frozenset(chr(symbol) for symbol in startOfData)
+
+    @classmethod
+    def build(cls, simulator):
+        """
+        Returns the prefilter for the given simulator, or None if none is possible.
+        """
+        symbols = simulator.start_symbols()
+        if symbols is None:
+            return None
+        return cls(*symbols)
+
+    def candidate(self, data, first):
+        """
+        Checks if the given data, scanned from an idle state, may produce a report.
+        The start-of-data STEs are considered only for the first buffer of a stream.
+        """
+        if first and data and data[0] in self._startOfData:
+            return True
+        return len(data.translate(None, self._others)) > 0
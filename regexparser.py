@@ -33,6 +33,7 @@
 # IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 import re
+import string
 
 class RegexParser(object):
     """
@@ -56,8 +57,18 @@ class RegexParser(object):
         'at_end' : r'$',
     }
 
-    def __init__(self, regex):
-        self._parsed = re.sre_parse.parse(regex)
+    _categorySymbols = {
+        'category_digit' : frozenset(ord(c) for c in string.digits),
+        'category_space' : frozenset(ord(c) for c in ' \t\n\r\f\v'),
+        'category_word' : frozenset(ord(c) for c in string.ascii_letters + string.digits + '_'),
+    }
+    for _category in _categorySymbols.keys():
+        _categorySymbols[_category.replace('category_', 'category_not_')] = frozenset(xrange(256)) - _categorySymbols[_category]
+    del _category
+
+    def __init__(self, regex, flags = 0):
+        self._parsed = re.sre_parse.parse(regex, flags)
+        self._flags = flags
         self._repeat_bound = None
         self._cache = dict()
         self._cases = {
@@ -100,6 +111,85 @@ class RegexParser(object):
             newstr.append(self._handle_state(state))
         return None if not self._is_changed else ''.join(newstr)
 
+    def literal_length(self):
+        """
+        Returns the length of the longest run of literals, outside of any
+        repetition or group, in the regex.
+        """
+        longest = 0
+        current = 0
+        for opcode, value in self._parsed:
+            if opcode == 'literal':
+                current += 1
+                longest = max(longest, current)
+            elif opcode != 'at':
+                current = 0
+        return longest
+
+    def generate(self, random, repeat_limit = 8):
+        """
+        Builds and returns a random string matched by the regex, as Xeger does.
+        Unbounded repetitions are repeated at most the given limit more times
+        than their minimum. Lookaheads are generated in place and anchors and
+        negative lookarounds are ignored, so the caller should check the string
+        against the regex.
+        """
+        self._random = random
+        self._repeat_limit = repeat_limit
+        self._groups = dict()
+        return self._generate_sequence(self._parsed)
+
+    def _generate_sequence(self, states):
+        return ''.join(self._generate_state(state) for state in states)
+
+    def _generate_state(self, state):
+        opcode, value = state
+        if opcode == 'literal':
+            return chr(value)
+        if opcode in ('not_literal', 'in', 'any', 'category'):
+            return chr(self._random.choice(self._symbols(opcode, value)))
+        if opcode == 'branch':
+            return self._generate_sequence(self._random.choice(value[1]))
+        if opcode == 'subpattern':
+            result = self._generate_sequence(value[1])
+            if value[0]:
+                self._groups[value[0]] = result
+            return result
+        if opcode == 'groupref':
+            return self._groups.get(value, '')
+        if opcode in ('max_repeat', 'min_repeat'):
+            start_range, end_range, states = value
+            count = self._random.randint(start_range, min(end_range, start_range + self._repeat_limit))
+            return ''.join(self._generate_sequence(states) for i in xrange(count))
+        if opcode == 'assert' and value[0] > 0:
+            return self._generate_sequence(value[1])
+        return ''
+
+    def _symbols(self, opcode, value):
+        """
+        Returns the sorted symbols accepted by the given single character state.
+        """
+        if opcode == 'not_literal':
+            return [symbol for symbol in xrange(256) if symbol != value]
+        if opcode == 'any':
+            return range(256) if self._flags & re.DOTALL else [symbol for symbol in xrange(256) if symbol != ord('\n')]
+        if opcode == 'category':
+            return sorted(self._categorySymbols[value])
+        symbols = set()
+        negate = False
+        for item, itemValue in value:
+            if item == 'negate':
+                negate = True
+            elif item == 'literal':
+                symbols.add(itemValue)
+            elif item == 'range':
+                symbols.update(xrange(itemValue[0], itemValue[1] + 1))
+            elif item == 'category':
+                symbols.update(self._categorySymbols[itemValue])
+        if negate:
+            symbols = set(xrange(256)) - symbols
+        return sorted(symbols)
+
     def _handle_state(self, state):
         opcode, value = state
         return self._cases[opcode](value)
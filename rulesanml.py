@@ -21,7 +21,14 @@ import exceptions
 import os
 import re
 import sys
+import tempfile
 
+from anmlsimulator import AnmlSimulator
+from backendrouter import BackendRouter, RouterException
+from hostcombiner import HostCombiner, CombinerException
+from hostverifier import RuleVerifier, WindowVerifier, VerifierException
+from lazydfa import LazyDfa
+from manifest import Manifest
 from regexparser import RegexParser
 
 class AnmlException(exceptions.Exception):
@@ -31,11 +38,24 @@ class RulesAnml(object):
     """
     Class for storing ANML-NFAs corresponding to the Snort rules.
     """
-    def __init__(self, directory, maxStes = 0, maxRepeats = 0, backreferences = False):
+    # relative cost of verifying one byte on the host per scanned byte,
+    # in the units of the fraction of a half-core used
+    _hostByteCost = 1.0
+
+    def __init__(self, directory, maxStes = 0, maxRepeats = 0, backreferences = False, hostBooleans = False, hostWindows = False, router = None):
         self._maxStes = maxStes
         self._maxRepeats = maxRepeats
         self._backreferences = backreferences
+        self._hostBooleans = hostBooleans
+        self._hostWindows = hostWindows
+        self._router = router
         self._anmlNetworks = {}
+        # keyword, resources and rules of every bucket, and the patterns of the
+        # rules of every keyword, for the manifest
+        self._bucketInfo = {}
+        self._rules = {}
+        # complete DFA of every bucket scanned by a DFA, grown with every rule added
+        self._dfas = {}
         self._counter = 0
 
         if self._maxRepeats > 0:
@@ -46,6 +66,13 @@ class RulesAnml(object):
             self._backreferenceSids = set()
             self._backreferenceFile = open(os.path.join(directory, 'backreferences.txt'), 'wb')
 
+        if self._hostBooleans:
+            self._combinationsFile = open(os.path.join(directory, HostCombiner.fileName), 'wb')
+
+        if self._hostWindows:
+            self._windows = {}
+            self._windowsFile = open(os.path.join(directory, WindowVerifier.fileName), 'wb')
+
         self._orAnchorPattern = re.compile(r'^\/(?P<before>.*)(?P<start>\(|\(.*?\|)\$(?P<end>\|.*?\)|\))(?P<after>(?:\)*))\/(?P<modifiers>\w*)$')
         self._anchorPattern = re.compile(r'^\/(?P<open>(?:\(\?\w*:)?)(?P<start>\^?)(?P<pattern>.*?)(?<!\\)(?P<end>\$?)(?P<close>(?:\)*))\/(?P<modifiers>\w*)$')
         self._genericPattern = re.compile(r'^\/(?P<pattern>.*)\/(?P<modifiers>[ismexADSUXuJ]*)$')
@@ -119,6 +146,100 @@ class RulesAnml(object):
 
         return mainAnd, eodAnd
 
+    def _add_negative_dependent_counter(self, network, regex, dependent, reportCode):
+        # a latch, enabled by the regex, counts the cycles of the window and
+        # another counter remembers if the expression was seen in the window
+        expression, depth = dependent
+        exprRegex = network.AddRegex(expression)
+        network.AddAnmlEdge(regex, exprRegex)
+        ste = network.AddSTE('*')
+        network.AddAnmlEdge(regex, ste, ap.AnmlDefs.PORT_IN)
+        network.AddAnmlEdge(ste, ste, ap.AnmlDefs.PORT_IN)
+
+        window = network.AddCounter(depth, mode = ap.CounterMode.STOP_PULSE)
+        network.AddAnmlEdgeEx(ste, 0, window, ap.AnmlDefs.COUNT_ONE_PORT)
+        network.AddAnmlEdgeEx(regex, 0, window, ap.AnmlDefs.RESET_PORT)
+
+        seen = network.AddCounter(1, mode = ap.CounterMode.STOP_HOLD)
+        network.AddAnmlEdgeEx(exprRegex, 0, seen, ap.AnmlDefs.COUNT_ONE_PORT)
+        network.AddAnmlEdgeEx(regex, 0, seen, ap.AnmlDefs.RESET_PORT)
+
+        booleanNot = network.AddBoolean(mode = ap.BooleanMode.NOT, anmlId = self._next_boolean_id())
+        network.AddAnmlEdge(seen, booleanNot)
+
+        kwargs = {'mode' : ap.BooleanMode.AND, 'anmlId' : self._next_boolean_id()}
+        if reportCode is not None:
+            kwargs.update({'match' : True, 'reportCode' : reportCode})
+        mainAnd = network.AddBoolean(**kwargs)
+        network.AddAnmlEdge(window, mainAnd)
+        network.AddAnmlEdge(booleanNot, mainAnd)
+
+        # also reports at the end of data if the window is not complete
+        kwargs = {'mode' : ap.BooleanMode.AND, 'anmlId' : self._next_boolean_id()}
+        if reportCode is not None:
+            kwargs.update({'eod' : True, 'match' : True, 'reportCode' : reportCode})
+        eodAnd = network.AddBoolean(**kwargs)
+        network.AddAnmlEdge(ste, eodAnd)
+        if reportCode is not None:
+            # a latch, enabled once the main boolean reports, and the pulse of a
+            # window completed on the last symbol keep the end of data from
+            # reporting the rule again
+            done = network.AddSTE('*')
+            network.AddAnmlEdge(mainAnd, done, ap.AnmlDefs.PORT_IN)
+            network.AddAnmlEdge(done, done, ap.AnmlDefs.PORT_IN)
+            booleanNor = network.AddBoolean(mode = ap.BooleanMode.NOR, anmlId = self._next_boolean_id())
+            network.AddAnmlEdge(seen, booleanNor)
+            network.AddAnmlEdge(window, booleanNor)
+            network.AddAnmlEdge(done, booleanNor)
+            network.AddAnmlEdge(booleanNor, eodAnd)
+        else:
+            network.AddAnmlEdge(booleanNot, eodAnd)
+
+        return mainAnd, eodAnd
+
+    @staticmethod
+    def _window_code(sid, reportCode):
+        """
+        Returns the report code of the window of a pattern reporting the given
+        code in a rule, or None if the SID or the pattern index cannot be encoded.
+        """
+        decoded = HostCombiner.decode(reportCode)
+        try:
+            return WindowVerifier.encode(sid, decoded[1] if decoded is not None else 0)
+        except VerifierException:
+            return None
+
+    def _negative_dependent_lowering(self, pattern, dependent, sid, reportCode):
+        """
+        Chooses the cheapest lowering of a negated dependent expression: chains of
+        depth STEs, a counter gadget or, if enabled, a window check on the host.
+        """
+        expression, depth = dependent
+        costs = {
+            'chain' : BackendRouter.half_core_fraction(2 * depth - 1, 1, 4),
+            'counter' : BackendRouter.half_core_fraction(1, 2, 3) if reportCode is None else \
+                        BackendRouter.half_core_fraction(2, 2, 4),
+        }
+        if self._hostWindows and reportCode is not None and self._window_code(sid, reportCode) is not None:
+            # the window is verified for every hit of the pattern, whose rate is
+            # estimated assuming uniformly random bytes
+            try:
+                literals = RegexParser(self._genericPattern.match(pattern).group('pattern')).literal_length()
+            except re.sre_parse.error:
+                literals = 0
+            if RuleVerifier.verifiable([(expression, True, None)]):
+                costs['host'] = (256.0 ** -literals) * depth * self._hostByteCost
+        return min(costs.iterkeys(), key = lambda lowering : (costs[lowering], lowering))
+
+    def _add_host_window(self, network, regex, dependent, sid, reportCode):
+        windowCode = self._window_code(sid, reportCode)
+        expression, depth = dependent
+        self._windows[windowCode] = WindowVerifier.format_window(windowCode, reportCode, depth, expression)
+        boolean = network.AddBoolean(mode = ap.BooleanMode.OR, anmlId = self._next_boolean_id(),
+                                     match = True, reportCode = windowCode)
+        network.AddAnmlEdge(regex, boolean, ap.AnmlDefs.PORT_IN)
+        return boolean
+
     def _add_single_pattern(self, network, pattern, negation, dependent, sid, reportCode = None):
         matched = self._anchorPattern.match(pattern)
         kwargs = {'startType' : ap.AnmlDefs.START_OF_DATA if matched.group('start') else ap.AnmlDefs.ALL_INPUT}
@@ -171,7 +292,13 @@ class RulesAnml(object):
             network.AddAnmlEdge(regex, boolean, ap.AnmlDefs.PORT_IN)
             return (boolean, False)
         if dependent:
-            main, eod = self._add_negative_dependent(network, regex, dependent, reportCode)
+            lowering = self._negative_dependent_lowering(pattern, dependent, sid, reportCode)
+            if lowering == 'host':
+                return (self._add_host_window(network, regex, dependent, sid, reportCode), True)
+            elif lowering == 'counter':
+                main, eod = self._add_negative_dependent_counter(network, regex, dependent, reportCode)
+            else:
+                main, eod = self._add_negative_dependent(network, regex, dependent, reportCode)
             return [(main, True), (eod, False)]
         if not negation:
             if matched.group('end'):
@@ -186,18 +313,39 @@ class RulesAnml(object):
             self._latch_with_boolean(network, regex, boolean)
             return (boolean, True)
 
+    def _add_pattern_elements(self, network, pattern, negation, dependent, sid):
+        elements = []
+        returned = self._add_single_pattern(network, pattern, negation, dependent, sid)
+        returned = [returned] if not isinstance(returned, list) else returned
+        for element, latch in returned:
+            if negation or not latch:
+                elements.append(element)
+            else:
+                boolean = network.AddBoolean(mode = ap.BooleanMode.OR, anmlId = self._next_boolean_id())
+                self._latch_with_boolean(network, element, boolean)
+                elements.append(boolean)
+        return elements
+
     def _add_multiple_patterns(self, network, patterns, sid):
         elements = []
         for pattern, negation, dependent in patterns:
-            returned = self._add_single_pattern(network, pattern, negation, dependent, sid)
-            returned = [returned] if not isinstance(returned, list) else returned
-            for element, latch in returned:
-                if negation or not latch:
-                    elements.append(element)
-                else:
-                    boolean = network.AddBoolean(mode = ap.BooleanMode.OR, anmlId = self._next_boolean_id())
-                    self._latch_with_boolean(network, element, boolean)
-                    elements.append(boolean)
+            matched = self._match_or_anchor(pattern)
+            if matched is None:
+                elements.extend(self._add_pattern_elements(network, pattern, negation, dependent, sid))
+                continue
+            # the end of data and the other alternatives are added as two branches
+            # of one boolean, instead of duplicating the rule for each of them
+            before, altPattern, after, modifiers = matched
+            branches = network.AddBoolean(mode = ap.BooleanMode.OR, anmlId = self._next_boolean_id())
+            for alternative in ('$', altPattern):
+                branch = self._add_pattern_elements(network, '/' + before + alternative + after + '/' + modifiers, negation, dependent, sid)
+                if len(branch) > 1:
+                    boolean = network.AddBoolean(mode = ap.BooleanMode.AND, anmlId = self._next_boolean_id())
+                    for element in branch:
+                        network.AddAnmlEdge(element, boolean, ap.AnmlDefs.PORT_IN)
+                    branch = [boolean]
+                network.AddAnmlEdge(branch[0], branches, ap.AnmlDefs.PORT_IN)
+            elements.append(branches)
         return elements
 
     def _match_or_anchor(self, pattern):
@@ -211,8 +359,29 @@ class RulesAnml(object):
             altPattern = altPattern[0] if len(altPattern) == 1 else '(' + '|'.join(altPattern) + ')'
             return matched.group('before'), altPattern, matched.group('after'), matched.group('modifiers')
 
+    def _add_host_combined_patterns(self, network, sid, patterns):
+        # every pattern reports its own code and the AND is evaluated on the host
+        for index in xrange(len(patterns)):
+            pattern, negation, dependent = patterns[index]
+            try:
+                reportCode = HostCombiner.encode(sid, index)
+            except CombinerException, e:
+                raise AnmlException, str(e)
+            matched = self._match_or_anchor(pattern)
+            if matched is not None:
+                before, altPattern, after, modifiers = matched
+                pattern = '/' + before + after + '/' + modifiers
+                regex, latch = self._add_single_pattern(network, pattern, False, dependent, sid)
+                boolean = network.AddBoolean(mode = ap.BooleanMode.OR, anmlId = self._next_boolean_id(),
+                                             match = True, reportCode = reportCode, eod = True)
+                network.AddAnmlEdge(regex, boolean, ap.AnmlDefs.PORT_IN)
+                pattern = '/' + before + altPattern + after + '/' + modifiers
+            self._add_single_pattern(network, pattern, False, dependent, sid, reportCode = reportCode)
+
     def _add_patterns(self, network, sid, patterns):
-        if len(patterns) == 1:
+        if len(patterns) > 1 and self._hostBooleans:
+            self._add_host_combined_patterns(network, sid, patterns)
+        elif len(patterns) == 1:
             pattern, negation, dependent = patterns[0]
             matched = self._match_or_anchor(pattern)
             if matched is not None:
@@ -226,21 +395,55 @@ class RulesAnml(object):
 
             self._add_single_pattern(network, pattern, negation, dependent, sid, reportCode = sid)
         else:
-            for index in xrange(len(patterns)):
-                pattern, negation, dependent = patterns[index]
-                matched = self._match_or_anchor(pattern)
-                if matched is not None:
-                    before, altPattern, after, modifiers = matched
-                    patterns[index] = ('/' + before + '$' + after + '/' + modifiers, negation, dependent)
-                    self._add_patterns(network, sid, patterns)
-                    patterns[index] = ('/' + before + altPattern + after + '/' + modifiers, negation, dependent)
-                    self._add_patterns(network, sid, patterns)
-                    break
-            else:
-                elements = self._add_multiple_patterns(network, patterns, sid)
-                boolean = network.AddBoolean(mode = ap.BooleanMode.AND, reportCode = sid, match = True, eod = True, anmlId = self._next_boolean_id())
-                for element in elements:
-                    network.AddAnmlEdge(element, boolean, ap.AnmlDefs.PORT_IN)
+            elements = self._add_multiple_patterns(network, patterns, sid)
+            boolean = network.AddBoolean(mode = ap.BooleanMode.AND, reportCode = sid, match = True, eod = True, anmlId = self._next_boolean_id())
+            for element in elements:
+                network.AddAnmlEdge(element, boolean, ap.AnmlDefs.PORT_IN)
+
+    def _approximated(self, sid):
+        """
+        Checks if the automaton of the rule with the given SID may report false positives.
+        """
+        return (self._maxRepeats > 0 and sid in self._repetitionSids) or \
+               (self._backreferences and sid in self._backreferenceSids)
+
+    def _determinize(self, network):
+        """
+        Returns the complete DFA of the given network, or None if it has counters
+        or booleans or too many states.
+        """
+        # the determinization of the automaton is explored using its simulation
+        handle, anmlFile = tempfile.mkstemp(suffix = '.anml')
+        os.close(handle)
+        try:
+            network.ExportAnml(anmlFile)
+            if AnmlSimulator(anmlFile).numSpecials > 0:
+                return None
+            return LazyDfa(anmlFile).determinize(self._router.maxDfaStates)
+        finally:
+            os.remove(anmlFile)
+
+    def _route(self, keyword, sid, patterns, network, info):
+        """
+        Routes the rule, whose patterns were added to the given dummy network, to a backend.
+        """
+        dfa = None
+        if self._router.allows('dfa'):
+            dfa = self._determinize(network)
+            bucketDfa = self._dfas.get(BackendRouter.bucket(keyword, 'dfa'))
+            if dfa is not None and bucketDfa is not None:
+                # the rule is determinized along with the rest of its bucket,
+                # whose DFA is kept so that only the new rule is explored
+                dfa = LazyDfa.product(bucketDfa, dfa, self._router.maxDfaStates)
+        approximated = self._approximated(sid)
+        try:
+            backend = self._router.route(keyword, sid, patterns, info.ste_count, info.clock_divisor, info.counter_count,
+                                         info.boolean_count, len(dfa[2]) if dfa is not None else None, approximated)
+        except RouterException, e:
+            raise AnmlException, str(e)
+        if backend == 'dfa':
+            self._dfas[BackendRouter.bucket(keyword, 'dfa')] = dfa
+        return backend
 
     def add(self, keyword, sid, patterns):
         """
@@ -248,6 +451,8 @@ class RulesAnml(object):
         """
         # try to add the pattern to a dummy anml object first
         # this will throw an error, if there are any issues with patterns
+        if self._hostWindows:
+            self._windows.clear()
         anml = ap.Anml()
         network = anml.CreateAutomataNetwork()
         self._add_patterns(network, sid, patterns)
@@ -255,15 +460,26 @@ class RulesAnml(object):
         # check if the rule satisfies the maximum STEs limit
         automaton, emap = anml.CompileAnml()
         info = automaton.GetInfo()
-        if info.ste_count > 49152 / 2:
+        backend = 'ap'
+        if self._router is not None:
+            backend = self._route(keyword, sid, patterns, network, info)
+            if backend == 'host':
+                # the rule is matched by the host, so it needs no automaton
+                if self._hostWindows:
+                    self._windows.clear()
+                return
+        elif info.ste_count > BackendRouter.halfCoreStes:
             raise AnmlException, '\nAdding patterns for rule with SID %d failed.\nRequired resources exceeded those in one half-core.\n'%sid
-        bucket = keyword
-        if self._maxStes > 0:
-            if info.ste_count > self._maxStes:
-                bucket = '%s_%d'%(keyword, sid)
-        if info.clock_divisor > 1:
-            bucket = '%s_%d'%(keyword, info.clock_divisor)
-            #print keyword, sid, info.clock_divisor
+        bucket = BackendRouter.bucket(keyword, backend)
+        if backend == 'ap':
+            if self._maxStes > 0:
+                if info.ste_count > self._maxStes:
+                    bucket = '%s_%d'%(keyword, sid)
+            if info.clock_divisor > 1:
+                bucket = '%s_%d'%(keyword, info.clock_divisor)
+                #print keyword, sid, info.clock_divisor
+        if self._router is not None:
+            self._router.add_bucket(bucket, backend)
 
         # create a new network if it doesn't exist
         if bucket not in self._anmlNetworks:
@@ -275,6 +491,24 @@ class RulesAnml(object):
 
         # now add pattern to the network
         self._add_patterns(network, sid, patterns)
+        bucketInfo = self._bucketInfo.setdefault(bucket, {'keyword' : keyword, 'backend' : backend, 'stes' : 0,
+                                                          'counters' : 0, 'booleans' : 0, 'clock_divisor' : 1,
+                                                          'sids' : set(), 'approximated' : set(), 'rules' : []})
+        bucketInfo['stes'] += info.ste_count
+        bucketInfo['counters'] += info.counter_count
+        bucketInfo['booleans'] += info.boolean_count
+        bucketInfo['clock_divisor'] = max(bucketInfo['clock_divisor'], info.clock_divisor)
+        bucketInfo['sids'].add(sid)
+        bucketInfo['rules'].append((sid, patterns))
+        if self._approximated(sid):
+            bucketInfo['approximated'].add(sid)
+        self._rules.setdefault(keyword, []).append([sid, [list(pattern) for pattern in patterns]])
+        if self._hostBooleans and len(patterns) > 1:
+            self._combinationsFile.write(HostCombiner.format_rule(sid, [negation for pattern, negation, dependent in patterns]))
+        if self._hostWindows:
+            for windowCode in sorted(self._windows.iterkeys()):
+                self._windowsFile.write(self._windows[windowCode])
+            self._windows.clear()
 
 
     def export(self, directory):
@@ -283,6 +517,42 @@ class RulesAnml(object):
         """
         for bucket, anmlNetwork in self._anmlNetworks.iteritems():
             anmlNetwork[1].ExportAnml(os.path.join(directory, bucket + '.anml'))
+        if self._router is not None:
+            self._router.export(directory)
+
+    def write_manifest(self, directory):
+        """
+        Writes the manifest of all the buckets exported to the given directory.
+        """
+        buckets = {}
+        for bucket, bucketInfo in self._bucketInfo.iteritems():
+            anmlFile = os.path.join(directory, bucket + '.anml')
+            starts = AnmlSimulator(anmlFile).start_symbols()
+            keyword = bucketInfo['keyword']
+            raw = keyword.endswith('_raw')
+            buckets[bucket] = {
+                'keyword' : keyword[:-len('_raw')] if raw else keyword,
+                'raw' : raw,
+                'backend' : bucketInfo['backend'],
+                # resources summed over the rules, as compiled one at a time
+                'stes' : bucketInfo['stes'],
+                'counters' : bucketInfo['counters'],
+                'booleans' : bucketInfo['booleans'],
+                'clock_divisor' : bucketInfo['clock_divisor'],
+                'sids' : sorted(bucketInfo['sids']),
+                'approximated' : sorted(bucketInfo['approximated']),
+                'prefilter' : {'starts' : Manifest.symbols(starts[0]), 'start_of_data' : Manifest.symbols(starts[1])}
+                              if starts is not None else None,
+                'anml_sha1' : Manifest.file_hash(anmlFile),
+                'fsm_sha1' : Manifest.file_hash(os.path.join(directory, bucket + '.fsm')),
+            }
+        rules = dict((keyword, list(keywordRules)) for keyword, keywordRules in self._rules.iteritems())
+        verified = {}
+        if self._router is not None:
+            for keyword, keywordRules in self._router.verified_rules().iteritems():
+                verified[keyword] = sorted(sid for sid, patterns in keywordRules)
+                rules.setdefault(keyword, []).extend(keywordRules)
+        Manifest.write(directory, buckets, verified, rules)
 
     def compile(self, directory):
         """
@@ -291,6 +561,8 @@ class RulesAnml(object):
         for bucket, anmlNetwork in self._anmlNetworks.iteritems():
             #if 'general' not in keyword:
                 #continue
+            if self._router is not None and self._router.backend(bucket) != 'ap':
+                continue
             print '\nCompiling %s\n'%bucket
             try:
                 automata, emap = anmlNetwork[0].CompileAnml()
@@ -158,7 +158,7 @@ class RulesConverter(object):
                 supportedRules.extend(fileSupportedRules)
         return supportedRules, totalRuleCount, patternRuleCount
 
-    def __init__(self, directory, maxStes, maxRepeats, independent, negations, backreferences, compile):
+    def __init__(self, directory, maxStes, maxRepeats, independent, negations, backreferences, compile, hostBooleans = False, hostWindows = False, router = None):
         """
         Constructor. Stores some of the program options.
         """
@@ -166,11 +166,13 @@ class RulesConverter(object):
         self._independent = independent
         self._negations = negations
         self._compile = compile
+        self._router = router
 
         self._sids = set()
         self._unsupported = set()
+        self._ruleCounts = (0, 0, 0)
 
-        self._anml = RulesAnml(directory, maxStes, maxRepeats, backreferences)
+        self._anml = RulesAnml(directory, maxStes, maxRepeats, backreferences, hostBooleans, hostWindows, router)
 
         self._patternCount = defaultdict(int)
 
@@ -366,6 +368,9 @@ class RulesConverter(object):
                 try:
                     self._anml.add(keyword, sid, patterns)
                 except AnmlException, e:
+                    if self._router is not None and self._router.route_unsupported(keyword, sid, patterns, str(e)):
+                        self._patternCount[keyword] += len(patterns)
+                        continue
                     unsupported.add(sid)
                     self._error_message(str(e))
                 else:
@@ -377,9 +382,19 @@ class RulesConverter(object):
                     #outputFiles[keyword].write(writeString + '\n')
                 #else:
                     #print writeString
+        self._sids.update(sids)
+        self._unsupported.update(unsupported)
+        self._ruleCounts = (totalRuleCount, patternRuleCount, len(allRules))
         self._print_statistics(totalRuleCount, patternRuleCount, len(allRules), len(sids - unsupported))
         #print self._patternCount
 
+    def statistics(self):
+        """
+        Returns the numbers of rules, of rules with pattern matching keywords and
+        of supported rules, and the converted and the unsupported SIDs.
+        """
+        return self._ruleCounts + (self._sids - self._unsupported, self._unsupported)
+
     def export(self):
         """
         Write out the ANML-NFA or the AP-FSM to the given directory.
@@ -387,3 +402,4 @@ class RulesConverter(object):
         self._anml.export(self._directory)
         if self._compile:
             self._anml.compile(self._directory)
+        self._anml.write_manifest(self._directory)
@@ -0,0 +1,271 @@
+#!/usr/bin/env python
+
+##
+# @file scanbench.py
+# @brief Microbenchmarks of the kernels of the scan engine and of every bucket.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from argparse import ArgumentParser
+import json
+import multiprocessing
+import os
+import platform
+import random
+import re
+import socket
+import time
+
+from anmlsimulator import AnmlSimulator, SimulatorException
+from httpslicer import HttpSlicer
+from lazydfa import LazyDfa
+from manifest import Manifest
+from perfcounters import BucketCounters, PerfCounters
+from prefilter import Prefilter
+from scanengine import ScanEngine
+from trafficgen import RuleSampler, TrafficException, TrafficGenerator
+
+
+def machine_context():
+    """
+    Returns the description of the machine: its CPU model, flags and frequency,
+    number of CPUs and the version of Python.
+    """
+    cpu = {}
+    if os.path.exists('/proc/cpuinfo'):
+        with open('/proc/cpuinfo', 'rb') as cpuInfo:
+            for line in cpuInfo:
+                if not line.strip():
+                    # the first processor is enough
+                    break
+                name, sep, value = line.partition(':')
+                cpu[name.strip()] = value.strip()
+    return {
+        'date' : time.strftime('%Y-%m-%dT%H:%M:%S'),
+        'host_name' : socket.gethostname(),
+        'num_cpus' : multiprocessing.cpu_count(),
+        'cpu_model' : cpu.get('model name', platform.processor()),
+        'cpu_flags' : cpu.get('flags', '').split(),
+        'mhz_per_cpu' : float(cpu.get('cpu MHz', 0)),
+        'python' : platform.python_version(),
+        'platform' : platform.platform(),
+    }
+
+
+class MicroBenchmark(object):
+    """
+    Class for running benchmarks in the manner of Google Benchmark.
+
+    The number of iterations of every benchmark is grown until one run takes
+    at least the minimum time, and the run is then repeated; the median, mean
+    and standard deviation of the time per iteration over the repetitions are
+    reported, with the bytes processed per second. With the given hardware
+    counters, one more run reports the events per processed byte.
+    """
+    def __init__(self, minTime = 0.1, repetitions = 3, pattern = None, counters = None):
+        self._minTime = minTime
+        self._repetitions = repetitions
+        self._pattern = re.compile(pattern) if pattern is not None else None
+        self._counters = counters
+        self.results = []
+
+    @staticmethod
+    def _time(function, iterations):
+        wall = time.time()
+        cpu = time.clock()
+        for i in xrange(iterations):
+            function()
+        return time.time() - wall, time.clock() - cpu
+
+    def run(self, name, function, bytesPerIteration):
+        """
+        Runs the given benchmark, unless filtered out, and returns its result.
+        """
+        if self._pattern is not None and self._pattern.search(name) is None:
+            return None
+        iterations = 1
+        while True:
+            wall, cpu = self._time(function, iterations)
+            if wall >= self._minTime or iterations >= 1 << 30:
+                break
+            # aim a bit above the minimum time, growing at most tenfold
+            iterations = int(min(max(iterations * self._minTime * 1.4 / max(wall, 1e-9), iterations + 1), iterations * 10))
+        runs = [self._time(function, iterations) for r in xrange(self._repetitions)]
+        times = sorted(wall / iterations for wall, cpu in runs)
+        mean = sum(times) / len(times)
+        result = {
+            'name' : name,
+            'iterations' : iterations,
+            'repetitions' : self._repetitions,
+            'real_time' : times[len(times) // 2] * 1e9,
+            'real_time_mean' : mean * 1e9,
+            'real_time_stddev' : (sum((t - mean) ** 2 for t in times) / len(times)) ** 0.5 * 1e9,
+            'cpu_time' : sorted(cpu / iterations for wall, cpu in runs)[len(runs) // 2] * 1e9,
+            'time_unit' : 'ns',
+            'bytes_per_second' : bytesPerIteration / max(times[len(times) // 2], 1e-12),
+        }
+        self.results.append(result)
+        print '%-48s %14.0f ns %14.0f ns %12d %12.3f MB/s'%(name, result['real_time'], result['cpu_time'],
+              iterations, result['bytes_per_second'] / 1e6)
+        if self._counters is not None:
+            before = self._counters.read()
+            self._time(function, iterations)
+            counts = self._counters.delta(before, self._counters.read())
+            names = self._counters.names
+            result['counters'] = BucketCounters.per_byte(names, bytesPerIteration * iterations, counts)
+            print '%-48s %s'%('', BucketCounters.format(names, bytesPerIteration * iterations, counts))
+        return result
+
+
+class KernelInputs(object):
+    """
+    Class for the fixed inputs of the kernels of a bucket: the symbols of a
+    random buffer and the enabled and matched STEs of its simulation.
+    """
+    def __init__(self, simulator, data):
+        self.data = data
+        self.symbols = [ord(c) for c in data]
+        frontiers = list(simulator.frontiers(data))
+        self.enabled = [enabled for enabled, matched in frontiers]
+        self.matched = [matched for enabled, matched in frontiers]
+
+
+def mask_and_kernel(simulator, inputs):
+    """
+    Returns the kernel matching the enabled STEs against the symbol masks.
+    """
+    symbolMasks, startMatches, steSuccessors, stayMask = simulator.step_tables()
+    pairs = zip(inputs.enabled, inputs.symbols)
+    def kernel():
+        for enabled, symbol in pairs:
+            (enabled & symbolMasks[symbol]) | startMatches[symbol]
+    return kernel
+
+def propagation_kernel(simulator, inputs):
+    """
+    Returns the kernel enabling the successors of the matched STEs.
+    """
+    symbolMasks, startMatches, steSuccessors, stayMask = simulator.step_tables()
+    indices = AnmlSimulator._indices
+    matchedList = inputs.matched
+    def kernel():
+        for matched in matchedList:
+            following = matched & stayMask
+            for index in indices(matched):
+                following |= steSuccessors[index]
+    return kernel
+
+def lazy_dfa_kernel(dfa, inputs):
+    """
+    Returns the kernel stepping the lazy DFA, with its cache warmed up.
+    """
+    data = inputs.data
+    dfa.scan(data)
+    return lambda : dfa.scan(data)
+
+def prefilter_kernel(prefilter, inputs):
+    data = inputs.data
+    return lambda : prefilter.candidate(data, True)
+
+
+def traffic_buffers(directory, size, totalBytes, seed = 0, density = 0.01):
+    """
+    Returns the buffers of the given size with the generated traffic for the
+    rules in the manifest of the directory, or with noise if there is none.
+    """
+    generator = None
+    if os.path.exists(os.path.join(directory, Manifest.fileName)):
+        try:
+            generator = TrafficGenerator(directory, seed)
+        except TrafficException:
+            pass
+    noise = random.Random(seed)
+    buffers = []
+    for b in xrange(max(totalBytes // size, 1)):
+        payload = generator.payload(density, 0.0, size)[0] if generator is not None else ''
+        if len(payload) < size:
+            payload += RuleSampler.noise(noise, size - len(payload))
+        buffers.append(payload[:size])
+    return buffers
+
+
+if __name__ == '__main__':
+    parser = ArgumentParser(description = 'Benchmark the kernels of the scan engine and the buckets generated by fastsnap.py.')
+    parser.add_argument('directory', help = 'the directory with the generated buckets')
+    parser.add_argument('-b', '--buckets', help = 'comma separated buckets to be benchmarked, all by default',
+                        type = lambda buckets : buckets.split(','), metavar = 'B')
+    parser.add_argument('-f', '--filter', help = 'only run the benchmarks whose name matches the given regex',
+                        metavar = 'REGEX')
+    parser.add_argument('-l', '--length', help = 'length of the fixed input of the kernels in bytes',
+                        type = int, default = 4096, metavar = 'N')
+    parser.add_argument('-p', '--payloads', help = 'comma separated payload sizes of the end-to-end scans',
+                        type = lambda sizes : [int(size) for size in sizes.split(',')], default = [64, 512, 1460, 8192],
+                        metavar = 'SIZES')
+    parser.add_argument('-t', '--mintime', help = 'minimum time of a run of a benchmark in seconds',
+                        type = float, default = 0.1, metavar = 'T')
+    parser.add_argument('-r', '--repetitions', help = 'number of runs of every benchmark',
+                        type = int, default = 3, metavar = 'R')
+    parser.add_argument('-s', '--seed', help = 'seed of the inputs',
+                        type = int, default = 0, metavar = 'S')
+    parser.add_argument('-o', '--out', help = 'file to which the results are written as JSON',
+                        metavar = 'FILE')
+    parser.add_argument('-c', '--counters', help = 'also read the hardware counters of every benchmark',
+                        action = 'store_true')
+    args = parser.parse_args()
+
+    engine = ScanEngine(args.directory, args.buckets)
+    counters = PerfCounters() if args.counters else None
+    if counters is not None and counters.unavailable:
+        print 'Unavailable hardware counters: %s'%', '.join(counters.unavailable)
+    benchmark = MicroBenchmark(args.mintime, args.repetitions, args.filter, counters)
+    noise = random.Random(args.seed)
+    data = ''.join(chr(noise.randint(0, 255)) for i in xrange(args.length))
+    print '%-48s %17s %17s %12s %17s'%('benchmark', 'time', 'CPU', 'iterations', 'rate')
+    for bucket in engine.buckets():
+        bucketEngine = engine.engine(bucket)
+        simulator = bucketEngine.simulator if isinstance(bucketEngine, LazyDfa) else bucketEngine
+        inputs = KernelInputs(simulator, data)
+        benchmark.run('BM_MaskAnd/%s'%bucket, mask_and_kernel(simulator, inputs), len(data))
+        benchmark.run('BM_Propagate/%s'%bucket, propagation_kernel(simulator, inputs), len(data))
+        dfa = bucketEngine if isinstance(bucketEngine, LazyDfa) else None
+        if dfa is None:
+            try:
+                dfa = LazyDfa(os.path.join(args.directory, bucket + '.anml'))
+            except SimulatorException:
+                # the buckets with counters or booleans cannot be determinized
+                pass
+        if dfa is not None:
+            benchmark.run('BM_LazyDfaStep/%s'%bucket, lazy_dfa_kernel(dfa, inputs), len(data))
+        prefilter = Prefilter.build(simulator)
+        if prefilter is not None:
+            benchmark.run('BM_Prefilter/%s'%bucket, prefilter_kernel(prefilter, inputs), len(data))
+    slicer = HttpSlicer(engine.keywords())
+    for size in args.payloads:
+        payloads = traffic_buffers(args.directory, size, max(args.length, size) * 4, args.seed)
+        # every bucket scans the buffer of its keyword, as sliced by the runtime
+        sliced = [slicer.buffers(payload) for payload in payloads]
+        for bucket in engine.buckets():
+            keyword = ScanEngine.bucket_keyword(bucket)
+            buffers = [payloadBuffers[keyword] for payloadBuffers in sliced if keyword in payloadBuffers]
+            if not buffers:
+                continue
+            def scan(bucket = bucket, buffers = buffers):
+                for buffer in buffers:
+                    engine.scan_bucket(bucket, buffer)
+            benchmark.run('BM_Scan/%s/%d'%(bucket, size), scan, sum(len(buffer) for buffer in buffers))
+    if args.out is not None:
+        with open(args.out, 'wb') as outJson:
+            json.dump({'context' : machine_context(), 'benchmarks' : benchmark.results}, outJson,
+                      indent = 1, sort_keys = True)
@@ -0,0 +1,405 @@
+##
+# @file scanengine.py
+# @brief Scanning of the packet buffers with the buckets written by fastsnap.py.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from collections import defaultdict
+import hashlib
+import json
+import os
+import re
+
+from anmlsimulator import AnmlSimulator
+from backendrouter import BackendRouter
+from hostcombiner import HostCombiner
+from hostverifier import RuleVerifier, WindowVerifier
+from lazydfa import LazyDfa
+from manifest import Manifest
+from parallelscanner import ParallelScanner
+from prefilter import Prefilter
+
+
+class ScanEngine(object):
+    """
+    Class for scanning the buffers of the packets with all the buckets in an
+    output directory of fastsnap.py.
+
+    The buckets routed to a lazy DFA are scanned by one, while the others,
+    including those meant for the AP, are simulated. The reports of the buckets
+    are then resolved to SIDs using the host combination, window verification
+    and rule verification files, if present.
+    """
+    # suffixes of the bucket names which do not belong to the keyword
+    _suffixPattern = re.compile(r'(?:_(?:dfa|nfa))?(?:_\d+)?$')
+    # number of the last bytes of a stream kept for the rules verified on the host
+    _verifyWindow = 1 << 16
+
+    def __init__(self, directory, buckets = None, prefilter = False, previous = None):
+        """
+        Constructor. Loads the given buckets, or all the buckets, from the directory.
+        If enabled, the buckets are not scanned on the buffers rejected by their prefilter.
+        The buckets which are unchanged since the given previous engine was loaded,
+        e.g. after an incremental rebuild, are shared with it instead of being loaded.
+        The hashes of the ANML files are taken from the manifest, if any, unless
+        the files were modified after it was written.
+        """
+        routingFile = os.path.join(directory, BackendRouter.fileName)
+        routing = {}
+        if os.path.exists(routingFile):
+            with open(routingFile, 'rb') as routingJson:
+                routing = json.load(routingJson).get('buckets', {})
+        self._engines = {}
+        self._prefilters = {}
+        manifestFile = os.path.join(directory, Manifest.fileName)
+        manifest = Manifest(directory) if os.path.exists(manifestFile) else None
+        # digests of the ANML file and the backend of every bucket
+        self._digests = {}
+        self._anmlFiles = {}
+        self._keywordBuckets = defaultdict(list)
+        for fileName in sorted(os.listdir(directory)):
+            bucket, extension = os.path.splitext(fileName)
+            if extension != '.anml' or (buckets is not None and bucket not in buckets):
+                continue
+            anmlFile = os.path.join(directory, fileName)
+            digest = manifest.buckets.get(bucket, {}).get('anml_sha1') if manifest is not None else None
+            if digest is None or os.path.getmtime(anmlFile) > os.path.getmtime(manifestFile):
+                with open(anmlFile, 'rb') as anml:
+                    digest = hashlib.sha1(anml.read()).hexdigest()
+            digest += str(routing.get(bucket))
+            self._digests[bucket] = digest
+            self._anmlFiles[bucket] = anmlFile
+            self._keywordBuckets[self.bucket_keyword(bucket)].append(bucket)
+            if previous is not None and previous._digests.get(bucket) == digest and \
+               (not prefilter or bucket in previous._prefilters):
+                self._engines[bucket] = previous._engines[bucket]
+                if prefilter:
+                    self._prefilters[bucket] = previous._prefilters[bucket]
+                continue
+            if routing.get(bucket) == 'dfa':
+                self._engines[bucket] = LazyDfa(anmlFile)
+            else:
+                self._engines[bucket] = AnmlSimulator(anmlFile)
+            if prefilter:
+                engine = self._engines[bucket]
+                self._prefilters[bucket] = Prefilter.build(engine.simulator if isinstance(engine, LazyDfa) else engine)
+        combinationsFile = os.path.join(directory, HostCombiner.fileName)
+        self._combiner = HostCombiner(combinationsFile) if os.path.exists(combinationsFile) else None
+        windowsFile = os.path.join(directory, WindowVerifier.fileName)
+        self._windows = WindowVerifier(windowsFile) if os.path.exists(windowsFile) else None
+        self._verifier = RuleVerifier(routingFile) if os.path.exists(routingFile) else None
+        # SIDs of the rules combined on the host in every bucket
+        self._combinedSids = {}
+        for bucket, engine in self._engines.iteritems():
+            simulator = engine.simulator if isinstance(engine, LazyDfa) else engine
+            decoded = (HostCombiner.decode(reportCode) for reportCode in simulator.report_codes())
+            self._combinedSids[bucket] = frozenset(d[0] for d in decoded if d is not None)
+        self._keywords = set(self._keywordBuckets.iterkeys())
+        # SIDs of the rules disabled at run time
+        self._disabled = frozenset()
+        # hardware counters of the scans of every bucket, if measured
+        self._counters = None
+        # workers scanning the large buffers, started on the first one, and the size of a large buffer
+        self._parallel = None
+        self._parallelWorkers = 0
+        self._parallelSize = None
+        # generation of the buffer in which every SID was last reported
+        self._stamps = {}
+        self._generation = 0
+        if self._verifier is not None:
+            self._keywords.update(self._verifier.keywords())
+
+    @classmethod
+    def directory_keywords(cls, directory):
+        """
+        Returns the keywords of the buckets in the given directory, without loading them.
+        """
+        keywords = set(cls.bucket_keyword(os.path.splitext(fileName)[0]) for fileName in os.listdir(directory)
+                       if fileName.endswith('.anml'))
+        routingFile = os.path.join(directory, BackendRouter.fileName)
+        if os.path.exists(routingFile):
+            keywords.update(RuleVerifier(routingFile).keywords())
+        return keywords
+
+    @classmethod
+    def bucket_keyword(cls, bucket):
+        """
+        Returns the keyword, i.e. the buffer, scanned by the given bucket.
+        """
+        return cls._suffixPattern.sub('', bucket, count = 1)
+
+    def keywords(self):
+        return self._keywords
+
+    def buckets(self, keyword = None):
+        if keyword is None:
+            return sorted(self._engines.iterkeys())
+        return self._keywordBuckets.get(keyword, [])
+
+    def sids(self):
+        """
+        Returns the SIDs of all the rules which can be reported.
+        """
+        sids = set()
+        for engine in self._engines.itervalues():
+            simulator = engine.simulator if isinstance(engine, LazyDfa) else engine
+            sids.update(self.report_sid(reportCode) for reportCode in simulator.report_codes())
+        if self._verifier is not None:
+            sids.update(self._verifier.sids())
+        sids.discard(None)
+        return sids
+
+    def shares(self, other, keyword):
+        """
+        Checks if all the buckets of the given keyword are shared with another
+        engine, so that the scan states of one can be used with the other.
+        """
+        buckets = self._keywordBuckets.get(keyword, [])
+        return buckets == other.buckets(keyword) and all(self._engines[b] is other.engine(b) for b in buckets) and \
+               self.verified_rules(keyword) == other.verified_rules(keyword)
+
+    def verified_rules(self, keyword):
+        """
+        Returns the rules of the given keyword verified on the host.
+        """
+        return self._verifier.rules(keyword) if self._verifier is not None else []
+
+    def engine(self, bucket):
+        return self._engines[bucket]
+
+    @staticmethod
+    def read_sids(sidsFile):
+        """
+        Reads the SIDs, one per line, from the given file. The lines starting with # are ignored.
+        """
+        with open(sidsFile, 'rb') as sids:
+            return frozenset(int(line) for line in (l.strip() for l in sids) if line and not line.startswith('#'))
+
+    @staticmethod
+    def report_sid(reportCode):
+        """
+        Returns the SID of the rule of the given report code, or None if it is not known.
+        """
+        for decoder in (HostCombiner.decode, WindowVerifier.decode):
+            decoded = decoder(reportCode)
+            if decoded is not None:
+                return decoded[0]
+        return reportCode if isinstance(reportCode, (int, long)) else None
+
+    def set_disabled(self, sids, suppress = False):
+        """
+        Disables the rules with the given SIDs, and enables all the others, without
+        reloading the buckets. The reports of the disabled rules are dropped once
+        they are resolved to SIDs. If enabled, the components of the buckets which
+        only report disabled rules are also suppressed so that they are not scanned.
+        The buckets whose suppressed components are unchanged are left untouched.
+        """
+        self._disabled = frozenset(sids)
+        for bucket, engine in self._engines.iteritems():
+            simulator = engine.simulator if isinstance(engine, LazyDfa) else engine
+            components = set()
+            if suppress:
+                for component, reportCodes in simulator.component_reports().iteritems():
+                    if all(self.report_sid(reportCode) in self._disabled for reportCode in reportCodes):
+                        components.add(component)
+            if components == simulator.suppressed:
+                continue
+            engine.suppress(components)
+            if bucket in self._prefilters:
+                self._prefilters[bucket] = Prefilter.build(simulator)
+
+    def set_counters(self, counters):
+        """
+        Accumulates the hardware events of the scans of every bucket in the
+        given BucketCounters, or stops doing so if None.
+        """
+        self._counters = counters
+
+    def set_parallel(self, workers, size = 1 << 20):
+        """
+        Scans the buffers of at least the given size with the simulated buckets
+        on the given number of worker processes, or on this one if there are none.
+        """
+        self.close()
+        self._parallelWorkers = workers
+        self._parallelSize = size
+
+    def close(self):
+        """
+        Stops the workers scanning the large buffers, if started.
+        """
+        if self._parallel is not None:
+            self._parallel.close()
+            self._parallel = None
+
+    def candidates(self, keyword, data, first = True):
+        """
+        Returns the buckets of a keyword which are not rejected by their prefilter
+        for the given data, when scanned from an idle state.
+        """
+        candidates = set()
+        for bucket in self._keywordBuckets.get(keyword, ()):
+            prefilter = self._prefilters.get(bucket)
+            if prefilter is None or prefilter.candidate(data, first):
+                candidates.add(bucket)
+        return candidates
+
+    def scan_bucket(self, bucket, data, state = None, final = True, candidates = None):
+        """
+        Scans the given data with one bucket, starting from the given state.
+        A bucket in an idle state is skipped if it is not among the given candidates
+        or is rejected by its prefilter.
+        Returns the list of (offset in the data, report code) and the state after the scan.
+        """
+        start = AnmlSimulator.state_offset(state) if state is not None else 0
+        if not isinstance(state, tuple):
+            if candidates is not None:
+                skipped = bucket not in candidates
+            else:
+                prefilter = self._prefilters.get(bucket)
+                skipped = prefilter is not None and not prefilter.candidate(data, start == 0)
+            if skipped:
+                return [], start + len(data)
+        counters = self._counters
+        if counters is not None:
+            before = counters.read()
+        engine = self._engines[bucket]
+        if self._parallelWorkers and len(data) >= self._parallelSize and isinstance(engine, AnmlSimulator):
+            if self._parallel is None:
+                self._parallel = ParallelScanner(self._parallelWorkers)
+            reports, state = self._parallel.scan(self._anmlFiles[bucket], engine, data, state, final)
+        else:
+            reports, state = engine.scan(data, state, final)
+        if counters is not None:
+            counters.add(bucket, len(data), before)
+        return [(offset - start, reportCode) for offset, reportCode in reports], state
+
+    def scan(self, keyword, data, states = None, final = True, candidates = None):
+        """
+        Scans a buffer with all the buckets of its keyword.
+        The scan states of the buckets, if given, are read from and written to the
+        given dictionary so that a buffer can be scanned in segments. The host
+        state of every bucket is kept in the same dictionary, keyed by (bucket, 'host'),
+        and the verification state of the keyword by (keyword, 'verify').
+        Returns the list of (offset in the data, SID).
+        """
+        sids = []
+        for bucket in self._keywordBuckets.get(keyword, ()):
+            state = states.get(bucket) if states is not None else None
+            reports, state = self.scan_bucket(bucket, data, state, final, candidates)
+            host = None
+            if states is not None:
+                states[bucket] = state
+                host = states.setdefault((bucket, 'host'), {})
+            sids.extend(self.resolve_bucket(bucket, data, reports, host, final))
+        host = states.setdefault((keyword, 'verify'), {}) if states is not None else None
+        sids.extend(self.verify(keyword, data, host, final))
+        return sids
+
+    def aggregate(self, reports):
+        """
+        Reduces the reports of SIDs on a buffer to one per SID.
+        Every SID is stamped with the generation of the buffer when it is first
+        seen, so that nothing has to be cleared between the buffers.
+        Returns the list of (first offset, last offset, SID) in the order of the first reports.
+        """
+        self._generation += 1
+        generation = self._generation
+        stamps = self._stamps
+        aggregated = []
+        for offset, sid in reports:
+            stamp = stamps.get(sid)
+            if stamp is None or stamp[0] != generation:
+                stamps[sid] = (generation, len(aggregated))
+                aggregated.append([offset, offset, sid])
+            else:
+                entry = aggregated[stamp[1]]
+                entry[0] = min(entry[0], offset)
+                entry[1] = max(entry[1], offset)
+        return [tuple(entry) for entry in aggregated]
+
+    @staticmethod
+    def aggregate_stream(aggregated, reports):
+        """
+        Adds the reports of SIDs on a segment of a stream, at offsets in the stream,
+        to the given [first offset, last offset] of every SID seen in the stream.
+        Returns the (offset, SID) of the SIDs reported for the first time.
+        """
+        first = []
+        for offset, sid in reports:
+            entry = aggregated.get(sid)
+            if entry is None:
+                aggregated[sid] = [offset, offset]
+                first.append((offset, sid))
+            else:
+                entry[0] = min(entry[0], offset)
+                entry[1] = max(entry[1], offset)
+        return first
+
+    @staticmethod
+    def aggregated_reports(aggregated, last = False):
+        """
+        Returns the (first or last offset, SID) of every SID seen in a stream,
+        in the order of the first reports.
+        """
+        entries = sorted((first, lastOffset, sid) for sid, (first, lastOffset) in aggregated.iteritems())
+        return [(lastOffset if last else first, sid) for first, lastOffset, sid in entries]
+
+    def resolve_bucket(self, bucket, data, reports, host = None, final = True):
+        """
+        Resolves the reports of a bucket on the given data to SIDs.
+        The rules combined on the host are evaluated per data, unless the host
+        state of a stream is given: the open windows and the matched patterns
+        are then carried in it from one segment to the next, every rule is
+        reported at most once and the rules with negated patterns are only
+        evaluated on the final segment.
+        """
+        if host is None:
+            host = {}
+        if self._windows is not None:
+            reports = self._windows.verify(data, reports, host.setdefault('windows', []), final)
+        if self._combiner is not None and data:
+            matches = host.setdefault('matches', {})
+            reported = host.setdefault('reported', set())
+            reports = self._combiner.update(matches, reports)
+            combined = [sid for sid in self._combiner.evaluate(matches, self._combinedSids[bucket], final)
+                        if sid not in reported]
+            reported.update(combined)
+            reports.extend((len(data) - 1, sid) for sid in combined)
+        if self._disabled:
+            reports = [(offset, sid) for offset, sid in reports if sid not in self._disabled]
+        return reports
+
+    def verify(self, keyword, data, host = None, final = True):
+        """
+        Returns the (offset in the data, SID) of the rules of a keyword verified on the host.
+        The rules are verified per data, unless the verification state of a
+        stream is given: the last bytes of the stream, up to the verification
+        window, and the patterns found so far are then carried in it from one
+        segment to the next, every rule is reported at most once and the rules
+        with negated patterns are only evaluated on the final segment.
+        """
+        if self._verifier is None or not data or not self._verifier.rules(keyword):
+            return []
+        if host is None:
+            sids = self._verifier.verify(keyword, data)
+        else:
+            buffered = host.get('buffer', '') + data
+            reported = host.setdefault('reported', set())
+            sids = [sid for sid in self._verifier.verify(keyword, buffered, host.setdefault('found', set()), final)
+                    if sid not in reported]
+            reported.update(sids)
+            host['buffer'] = buffered[-self._verifyWindow:]
+        return [(len(data) - 1, sid) for sid in sids if sid not in self._disabled]
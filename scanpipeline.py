@@ -0,0 +1,275 @@
+#!/usr/bin/env python
+
+##
+# @file scanpipeline.py
+# @brief Staged scanning pipeline: decode, HTTP slicing, prefilter, scan and report.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from argparse import ArgumentParser
+from multiprocessing import Process, Queue
+import time
+
+from httpslicer import HttpSlicer
+from pcapreader import PcapReader, decode_packet
+from scanengine import ScanEngine
+from snapruntime import CpuList, FlowScanner, RssHash, TextAlertLog, set_affinity
+
+
+class StageMetrics(object):
+    """
+    Class for measuring the depth of the input queue of a stage and the time
+    it spends in serving its batches.
+    """
+    def __init__(self, name):
+        self.name = name
+        self.batches = 0
+        self.items = 0
+        self.busy = 0.0
+        self._depthSum = 0
+        self._depthMax = 0
+        self._samples = 0
+
+    def sample(self, depth):
+        self._depthSum += depth
+        self._depthMax = max(self._depthMax, depth)
+        self._samples += 1
+
+    def record(self, items, seconds):
+        self.batches += 1
+        self.items += items
+        self.busy += seconds
+
+    def summary(self):
+        return {
+            'stage' : self.name,
+            'batches' : self.batches,
+            'items' : self.items,
+            'busy' : self.busy,
+            'mean_depth' : float(self._depthSum) / self._samples if self._samples else 0.0,
+            'max_depth' : self._depthMax,
+        }
+
+
+class SliceStage(object):
+    """
+    Stage which slices the payload of every packet into the keyword buffers.
+    """
+    def __init__(self, directory):
+        self._slicer = HttpSlicer(ScanEngine.directory_keywords(directory))
+
+    def process(self, batch):
+        return [(0, [(packet, self._slicer.buffers(packet.payload)) for packet in batch])]
+
+
+class PrefilterStage(object):
+    """
+    Stage which finds the candidate buckets of every buffer and sends every
+    packet to the scan worker of its flow.
+    """
+    def __init__(self, directory, workers):
+        self._engine = ScanEngine(directory, prefilter = True)
+        self._hash = RssHash()
+        self._workers = workers
+
+    def process(self, batch):
+        batches = [[] for w in xrange(self._workers)]
+        for packet, buffers in batch:
+            candidates = dict((keyword, self._engine.candidates(keyword, data)) for keyword, data in buffers.iteritems())
+            batches[self._hash(packet) % self._workers].append((packet, buffers, candidates))
+        return [(worker, workerBatch) for worker, workerBatch in enumerate(batches) if workerBatch]
+
+
+class ScanStage(object):
+    """
+    Stage which scans the candidate buckets for the flows of one worker.
+    """
+    def __init__(self, directory, stream, aggregate):
+        self._alerts = []
+        self._scanner = FlowScanner(ScanEngine(directory, prefilter = True), lambda *alert : self._alerts.append(alert),
+                                    stream, aggregate)
+
+    def process(self, batch):
+        for packet, buffers, candidates in batch:
+            self._scanner.process(packet, buffers, candidates)
+        return self._flush()
+
+    def _flush(self):
+        alerts, self._alerts = self._alerts, []
+        return [(0, alerts)] if alerts else []
+
+    def close(self):
+        self._scanner.close()
+        return self._flush()
+
+
+class ReportStage(object):
+    """
+    Stage which logs the alerts of all the scan workers.
+    """
+    def __init__(self, logFile):
+        self._log = TextAlertLog(logFile) if logFile is not None else None
+
+    def process(self, batch):
+        if self._log is not None:
+            for alert in batch:
+                self._log(*alert)
+        return []
+
+    def close(self):
+        if self._log is not None:
+            self._log.close()
+        return []
+
+
+def _run_stage(name, stageClass, stageArgs, inQueue, outQueues, producers, metricsQueue, cpu):
+    """
+    Runs a stage, in its own process, until all its producers have sent None.
+    The time blocked on a full output queue is not counted as service time, so
+    that it shows up as the depth of the queue of the slower consumer.
+    """
+    try:
+        if cpu is not None:
+            set_affinity([cpu])
+        stage = stageClass(*stageArgs)
+    except Exception, e:
+        metricsQueue.put((name, '%s: %s'%(type(e).__name__, e)))
+        return
+    # signal that the stage is ready
+    metricsQueue.put((name, None))
+    metrics = StageMetrics(name)
+    finished = 0
+    while finished < producers:
+        metrics.sample(inQueue.qsize())
+        batch = inQueue.get()
+        if batch is None:
+            finished += 1
+            continue
+        t = time.time()
+        outputs = stage.process(batch)
+        metrics.record(len(batch), time.time() - t)
+        for index, output in outputs:
+            outQueues[index].put(output)
+    if hasattr(stage, 'close'):
+        for index, output in stage.close():
+            outQueues[index].put(output)
+    for outQueue in outQueues:
+        outQueue.put(None)
+    metricsQueue.put(metrics.summary())
+
+
+class ScanPipeline(object):
+    """
+    Class for scanning the packets of a capture in a pipeline of stages.
+
+    The packets are decoded by the calling process and then flow through the
+    slicing, prefilter, scan and report stages, each in its own process, in
+    batches over bounded queues. The scan stage is replicated over multiple
+    workers, which receive the packets of their flows from the prefilter stage
+    and all send their alerts to the single report stage.
+    """
+    def __init__(self, directory, workers, stream = False, logFile = None, cpus = None,
+                 batchSize = 64, queueDepth = 16, aggregate = None):
+        self._batchSize = batchSize
+        self._sliceQueue = Queue(queueDepth)
+        prefilterQueue = Queue(queueDepth)
+        scanQueues = [Queue(queueDepth) for w in xrange(workers)]
+        reportQueue = Queue(queueDepth)
+        self._metricsQueue = Queue()
+        stages = [
+            ('slice', SliceStage, (directory,), self._sliceQueue, [prefilterQueue], 1),
+            ('prefilter', PrefilterStage, (directory, workers), prefilterQueue, scanQueues, 1),
+        ]
+        for worker in xrange(workers):
+            stages.append(('scan %d'%worker, ScanStage, (directory, stream, aggregate), scanQueues[worker], [reportQueue], 1))
+        stages.append(('report', ReportStage, (logFile,), reportQueue, [], workers))
+        self._processes = []
+        for index, (name, stageClass, stageArgs, inQueue, outQueues, producers) in enumerate(stages):
+            cpu = cpus[index % len(cpus)] if cpus else None
+            process = Process(target = _run_stage, args = (name, stageClass, stageArgs, inQueue, outQueues,
+                                                           producers, self._metricsQueue, cpu))
+            process.start()
+            self._processes.append(process)
+        errors = ['%s: %s'%(name, error) for name, error in (self._metricsQueue.get() for s in stages) if error is not None]
+        if errors:
+            for process in self._processes:
+                process.terminate()
+            raise RuntimeError, 'Unable to start the stages.\n%s'%'\n'.join(errors)
+
+    def run(self, reader):
+        """
+        Decodes the frames read by the given reader and feeds them to the pipeline.
+        Returns the metrics of all the stages.
+        """
+        metrics = StageMetrics('decode')
+        batch = []
+        t = time.time()
+        for frame in reader:
+            packet = decode_packet(frame[0], frame[1], reader.linkType)
+            if packet is not None:
+                batch.append(packet)
+            if len(batch) == self._batchSize:
+                metrics.record(len(batch), time.time() - t)
+                self._sliceQueue.put(batch)
+                batch = []
+                t = time.time()
+        if batch:
+            metrics.record(len(batch), time.time() - t)
+            self._sliceQueue.put(batch)
+        self._sliceQueue.put(None)
+        summaries = [metrics.summary()]
+        summaries.extend(self._metricsQueue.get() for p in self._processes)
+        for process in self._processes:
+            process.join()
+        order = ['decode', 'slice', 'prefilter', 'scan', 'report']
+        summaries.sort(key = lambda s : (order.index(s['stage'].split()[0]), s['stage']))
+        return summaries
+
+
+if __name__ == '__main__':
+    parser = ArgumentParser(description = 'Scan the packets of a pcap capture in a pipeline of stages.')
+    parser.add_argument('directory', help = 'the directory with the generated buckets')
+    parser.add_argument('pcap', help = 'the pcap capture to be scanned')
+    parser.add_argument('-w', '--workers', help = 'number of scan workers',
+                        type = int, default = 1, metavar = 'N')
+    parser.add_argument('-s', '--stream', help = 'scan the packets of every flow direction as a stream',
+                        action = 'store_true')
+    parser.add_argument('-a', '--aggregate', help = 'raise one alert per SID per buffer or stream, at its first or last match',
+                        choices = ('first', 'last'))
+    parser.add_argument('-b', '--batch', help = 'number of packets in a batch',
+                        type = int, default = 64, metavar = 'B')
+    parser.add_argument('-d', '--depth', help = 'number of batches in a queue between stages',
+                        type = int, default = 16, metavar = 'D')
+    parser.add_argument('-p', '--pin', help = 'CPUs to which the stages are pinned, in order, e.g. 0-7',
+                        type = CpuList, metavar = 'CPUS')
+    parser.add_argument('-l', '--log', help = 'file to which the alerts are logged',
+                        metavar = 'FILE')
+    args = parser.parse_args()
+
+    pipeline = ScanPipeline(args.directory, args.workers, args.stream, args.log, args.pin, args.batch, args.depth,
+                            args.aggregate)
+    with PcapReader(args.pcap) as reader:
+        t = time.time()
+        summaries = pipeline.run(reader)
+        t = time.time() - t
+
+    print '%-10s %10s %8s %10s %10s %10s %12s %8s'%('stage', 'items', 'batches', 'mean depth', 'max depth',
+                                                   'busy (s)', 'us/item', 'load')
+    for s in summaries:
+        print '%-10s %10d %8d %10.2f %10d %10.3f %12.1f %7.1f%%'%(s['stage'], s['items'], s['batches'], s['mean_depth'],
+              s['max_depth'], s['busy'], s['busy'] * 1e6 / s['items'] if s['items'] else 0.0, 100.0 * s['busy'] / t)
+    bottleneck = max(summaries, key = lambda s : s['busy'])
+    print 'Bottleneck stage: %s'%bottleneck['stage']
+    print 'Total time taken in scanning: %.3f s'%t
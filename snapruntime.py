@@ -0,0 +1,584 @@
+#!/usr/bin/env python
+
+##
+# @file snapruntime.py
+# @brief Multi-process scanning runtime with RSS-style sharding of the flows.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from argparse import ArgumentParser, ArgumentTypeError
+import ctypes
+import ctypes.util
+from multiprocessing import Process, Queue
+import os
+import signal
+import socket
+import sys
+import threading
+import time
+
+from alertlog import AlertWriter
+from flowtable import FlowTable
+from httpslicer import HttpSlicer
+from pcapreader import PcapReader
+from perfcounters import BucketCounters, PerfCounters
+from scanengine import ScanEngine
+from tenantpolicy import TenantPolicies
+
+
+def set_affinity(cpus):
+    """
+    Pins the calling process to the given CPUs.
+    """
+    libc = ctypes.CDLL(ctypes.util.find_library('c'), use_errno = True)
+    mask = (ctypes.c_ulong * 16)()
+    bits = ctypes.sizeof(ctypes.c_ulong) * 8
+    for cpu in cpus:
+        mask[cpu // bits] |= 1 << (cpu % bits)
+    if libc.sched_setaffinity(0, ctypes.sizeof(mask), mask) != 0:
+        errno = ctypes.get_errno()
+        raise OSError(errno, 'Unable to pin to CPUs %s: %s'%(cpus, os.strerror(errno)))
+
+
+def CpuList(value):
+    """
+    Parses a list of CPUs, e.g. 0-7,16-23, given on the command line.
+    """
+    cpus = []
+    try:
+        for part in value.split(','):
+            first, sep, last = part.partition('-')
+            cpus.extend(xrange(int(first), int(last if sep else first) + 1))
+    except ValueError:
+        raise ArgumentTypeError, 'Invalid list of CPUs "%s"!'%value
+    return cpus
+
+
+class RssHash(object):
+    """
+    Class for computing the Toeplitz hash of the flow of a packet, as done by
+    the receive side scaling of the NICs. The key repeats 0x6d5a, which makes
+    the hash the same for both directions of a flow.
+    """
+    _key = '\x6d\x5a' * 20
+    # length of the hashed input: source and destination addresses and ports
+    _inputLength = 12
+
+    def __init__(self):
+        key = int(self._key.encode('hex'), 16)
+        keyBits = len(self._key) * 8
+        window = lambda bit : (key >> (keyBits - 32 - bit)) & 0xffffffff
+        # contribution of every value of every input byte
+        self._tables = []
+        for position in xrange(self._inputLength):
+            table = [0] * 256
+            for value in xrange(256):
+                for bit in xrange(8):
+                    if value & (0x80 >> bit):
+                        table[value] ^= window(position * 8 + bit)
+            self._tables.append(table)
+
+    def __call__(self, packet):
+        data = packet.srcAddr + packet.dstAddr + chr(packet.srcPort >> 8) + chr(packet.srcPort & 0xff) + \
+               chr(packet.dstPort >> 8) + chr(packet.dstPort & 0xff)
+        value = 0
+        for table, byte in zip(self._tables, data):
+            value ^= table[ord(byte)]
+        return value
+
+
+class FlowScanner(object):
+    """
+    Class for scanning the packets of the flows owned by one worker.
+
+    Every packet buffer is scanned on its own by default. In the stream mode,
+    the buffers of every direction of a flow are scanned as one stream: the last
+    byte of every segment is held back so that the eod booleans are evaluated
+    on the true last byte when the flow is closed, evicted or expired. The
+    alerts are then aggregated per stream rather than per buffer: at its first
+    match, as soon as it is seen, or at its last match, once the stream ends.
+
+    The engine can be swapped for a reloaded one while scanning. The new flows
+    are scanned with the new engine, while every existing flow stays on the
+    engine, i.e. the generation, with which it was started, unless all the
+    buckets of its buffers are shared by the two, in which case the flow is
+    moved over when it is next seen. An old engine is released once its last
+    flow is finished.
+    """
+    def __init__(self, engine, onAlert, stream = False, aggregate = None, policies = None, **tableArgs):
+        """
+        Constructor. If aggregation is enabled, one alert is raised per SID per
+        buffer, or per stream, at either the first or the last offset at which
+        it matched. If tenant policies are given, the alerts of every flow are
+        limited to the rules of its tenant.
+        """
+        self._engine = engine
+        self._onAlert = onAlert
+        self._stream = stream
+        self._aggregate = aggregate
+        self._policies = policies
+        # number of flows on every generation of the engine
+        self._generations = {engine : 0}
+        # whether the streams of a keyword can be moved from an old generation to a new one
+        self._movable = {}
+        self._slicer = HttpSlicer(engine.keywords())
+        # the flows are owned by a single worker, so one shard suffices
+        self._table = FlowTable(shards = 1, onEvict = self._finish, **tableArgs)
+        self.packets = 0
+        self.bytes = 0
+        self.alerts = 0
+
+    @staticmethod
+    def flow_key(packet):
+        return FlowTable.flow_key(packet.protocol, packet.srcAddr, packet.srcPort, packet.dstAddr, packet.dstPort)
+
+    def _report(self, timestamp, key, keyword, reports, offset, aggregated = None):
+        """
+        Raises the alerts of the given reports, after aggregating them in the
+        given SIDs of a stream, if any, or per buffer.
+        """
+        if self._policies is not None and reports:
+            tenant = self._policies.tenant(key)
+            reports = [(reportOffset, sid) for reportOffset, sid in reports if self._policies.allowed(tenant, sid)]
+        if aggregated is not None:
+            first = ScanEngine.aggregate_stream(aggregated, [(offset + reportOffset, sid) for reportOffset, sid in reports])
+            reports = first if self._aggregate == 'first' else []
+            offset = 0
+        elif self._aggregate is not None and len(reports) > 1:
+            reports = [(first if self._aggregate == 'first' else last, sid)
+                       for first, last, sid in self._engine.aggregate(reports)]
+        for reportOffset, sid in reports:
+            self.alerts += 1
+            self._onAlert(timestamp, sid, key, keyword, offset + reportOffset)
+
+    def process(self, packet, buffers = None, candidates = None):
+        """
+        Scans all the buffers of the given packet.
+        The buffers, and the candidate buckets of every buffer, may be given if
+        they were computed by earlier stages.
+        """
+        self.packets += 1
+        self.bytes += len(packet.payload)
+        key = self.flow_key(packet)
+        if buffers is None:
+            buffers = self._slicer.buffers(packet.payload)
+        if candidates is None:
+            candidates = {}
+        if self._stream:
+            flow = self._table.lookup(key, packet.timestamp)
+            direction = int((packet.srcAddr, packet.srcPort) != key[1:3])
+            for keyword, data in buffers.iteritems():
+                if data:
+                    self._scan_segment(flow, direction, keyword, data, packet.timestamp, candidates.get(keyword))
+            if packet.closing:
+                flow = self._table.remove(key)
+                if flow is not None:
+                    self._finish(flow)
+        else:
+            for keyword, data in buffers.iteritems():
+                if data:
+                    reports = self._engine.scan(keyword, data, candidates = candidates.get(keyword))
+                    self._report(packet.timestamp, key, keyword, reports, 0)
+
+    @property
+    def engine(self):
+        return self._engine
+
+    @property
+    def generations(self):
+        return len(self._generations)
+
+    def swap(self, engine):
+        """
+        Scans the new flows with the given engine from now on.
+        """
+        self._engine = engine
+        self._generations.setdefault(engine, 0)
+        self._slicer = HttpSlicer(engine.keywords())
+        self._release()
+
+    def _release(self):
+        for engine, flows in self._generations.items():
+            if not flows and engine is not self._engine:
+                del self._generations[engine]
+                engine.close()
+                for key in [key for key in self._movable if engine in key[:2]]:
+                    del self._movable[key]
+
+    def _flow_engine(self, flow):
+        """
+        Returns the engine of the given flow, after moving the flow to the current
+        engine if it is new or if it can be moved.
+        """
+        engine = flow.generation
+        if engine is self._engine:
+            return engine
+        if engine is not None:
+            for direction, keyword in flow.states:
+                movable = self._movable.get((engine, self._engine, keyword))
+                if movable is None:
+                    movable = self._movable[(engine, self._engine, keyword)] = self._engine.shares(engine, keyword)
+                if not movable:
+                    return engine
+            self._generations[engine] -= 1
+            if not self._generations[engine]:
+                self._release()
+        flow.generation = self._engine
+        self._generations[self._engine] += 1
+        return self._engine
+
+    def _scan_segment(self, flow, direction, keyword, data, now, candidates):
+        engine = self._flow_engine(flow)
+        streamKey = (direction, keyword)
+        # the SIDs seen in the stream, if aggregated
+        held, states, offset, aggregated = flow.states.get(streamKey, ('', {}, 0, {} if self._aggregate else None))
+        if held and candidates is not None:
+            candidates = candidates.union(engine.candidates(keyword, held, offset == 0))
+        data = held + data
+        self._report(now, flow.key, keyword, engine.scan(keyword, data[:-1], states, False, candidates), offset,
+                     aggregated)
+        self._table.update(flow, streamKey, (data[-1], states, offset + len(data) - 1, aggregated), now)
+
+    def _finish(self, flow):
+        """
+        Scans the held back bytes of a flow which is no longer tracked.
+        """
+        engine = flow.generation
+        for (direction, keyword), (held, states, offset, aggregated) in flow.states.iteritems():
+            self._report(flow.lastSeen, flow.key, keyword, engine.scan(keyword, held, states, True), offset, aggregated)
+            if aggregated and self._aggregate == 'last':
+                for reportOffset, sid in ScanEngine.aggregated_reports(aggregated, True):
+                    self.alerts += 1
+                    self._onAlert(flow.lastSeen, sid, flow.key, keyword, reportOffset)
+        flow.states.clear()
+        if engine is not None:
+            flow.generation = None
+            self._generations[engine] -= 1
+            if not self._generations[engine]:
+                self._release()
+
+    def close(self):
+        """
+        Finishes all the tracked flows.
+        """
+        self._table.expire(float('inf'))
+        for engine in self._generations:
+            engine.close()
+
+
+class TextAlertLog(object):
+    """
+    Class for logging the alerts as lines of text.
+    """
+    def __init__(self, logFile):
+        self._file = open(logFile, 'wb')
+
+    def __call__(self, timestamp, sid, key, keyword, offset):
+        protocol, srcAddr, srcPort, dstAddr, dstPort = key
+        self._file.write('%.6f %d %d %s:%d %s:%d %s %d\n'%(timestamp, sid, protocol, socket.inet_ntoa(srcAddr), srcPort,
+                                                           socket.inet_ntoa(dstAddr), dstPort, keyword, offset))
+
+    def close(self):
+        self._file.close()
+
+
+class PolicyWatcher(object):
+    """
+    Class for applying the SIDs disabled in a file to an engine whenever the
+    file is modified, so that a policy can be changed while scanning.
+    """
+    def __init__(self, engine, sidsFile, suppress = False, unused = ()):
+        """
+        Constructor. The given unused SIDs are always disabled along with those in the file.
+        """
+        self._engine = engine
+        self._sidsFile = sidsFile
+        self._suppress = suppress
+        self._unused = frozenset(unused)
+        self._modified = None
+        self.check()
+
+    def check(self):
+        """
+        Applies the disabled SIDs if the file was modified since the last check.
+        """
+        try:
+            modified = os.stat(self._sidsFile).st_mtime
+        except OSError:
+            # the file is being replaced; keep the current policy
+            return
+        if modified != self._modified:
+            self._modified = modified
+            self._engine.set_disabled(self._unused.union(ScanEngine.read_sids(self._sidsFile)), self._suppress)
+
+
+def open_alert_log(logDirectory, index, binary):
+    """
+    Opens the alert log of the worker with the given index in a directory,
+    in the binary format written off the scanning thread or as text.
+    """
+    if logDirectory is None:
+        return None
+    if binary:
+        return AlertWriter(os.path.join(logDirectory, 'alerts.%d.bin'%index))
+    return TextAlertLog(os.path.join(logDirectory, 'alerts.%d.txt'%index))
+
+
+class EngineLoader(object):
+    """
+    Class for loading the next generation of the engine in a background thread,
+    so that the scanning goes on while the changed buckets are loaded. The new
+    engine shares the unchanged buckets with the one being scanned, so it must
+    only be configured, e.g. its disabled rules set, on the scanning thread.
+    """
+    def __init__(self, directory, prefilter, previous):
+        self.engine = None
+        self.error = None
+        self._thread = threading.Thread(target = self._load, args = (directory, prefilter, previous))
+        self._thread.daemon = True
+        self._thread.start()
+
+    def _load(self, directory, prefilter, previous):
+        try:
+            self.engine = ScanEngine(directory, prefilter = prefilter, previous = previous)
+        except Exception, e:
+            self.error = '%s: %s'%(type(e).__name__, e)
+
+    def done(self):
+        return not self._thread.is_alive()
+
+    def join(self):
+        self._thread.join()
+
+
+def _run_worker(index, directory, queue, results, cpu, stream, aggregate, prefilter, disabledFile, suppress,
+                tenantsFile, logDirectory, binary, counters, parallel):
+    """
+    Scans the batches of packets received from the dispatcher until None is received.
+    On receiving RELOAD, the buckets are reloaded in the background and the
+    scanner is switched over to them between two batches.
+    """
+    def configure(engine):
+        engine.set_counters(bucketCounters)
+        if parallel is not None:
+            engine.set_parallel(*parallel)
+        # the rules of no tenant are disabled for good
+        unused = policies.unused(engine.sids()) if policies is not None else ()
+        policy = PolicyWatcher(engine, disabledFile, suppress, unused) if disabledFile is not None else None
+        if policy is None and unused:
+            engine.set_disabled(unused, suppress)
+        return policy
+
+    try:
+        if cpu is not None:
+            set_affinity([cpu])
+        # the hardware events of the scans of every bucket, if measured
+        bucketCounters = BucketCounters(PerfCounters()) if counters else None
+        engine = ScanEngine(directory, prefilter = prefilter)
+        policies = TenantPolicies(tenantsFile) if tenantsFile is not None else None
+        policy = configure(engine)
+    except Exception, e:
+        results.put((index, '%s: %s'%(type(e).__name__, e)))
+        return
+    # signal the dispatcher that the worker is ready
+    results.put((index, None))
+    log = open_alert_log(logDirectory, index, binary)
+    scanner = FlowScanner(engine, log if log is not None else lambda *alert : None, stream, aggregate, policies)
+    busy = 0.0
+    loader = None
+    reloads = 0
+    pending = False
+    while True:
+        batch = queue.get()
+        if batch is None:
+            break
+        if batch == ScanRuntime.RELOAD:
+            pending = True
+        if loader is not None and loader.done():
+            engine, error = loader.engine, loader.error
+            if engine is not None:
+                try:
+                    reloaded = configure(engine)
+                except Exception, e:
+                    engine, error = None, '%s: %s'%(type(e).__name__, e)
+            if engine is not None:
+                scanner.swap(engine)
+                policy = reloaded
+                reloads += 1
+            else:
+                print >> sys.stderr, 'Worker %d: unable to reload the buckets.\n%s'%(index, error)
+            loader = None
+        if pending and loader is None:
+            loader = EngineLoader(directory, prefilter, scanner.engine)
+            pending = False
+        if batch == ScanRuntime.RELOAD:
+            continue
+        t = time.time()
+        if policy is not None:
+            policy.check()
+        for packet in batch:
+            scanner.process(packet)
+        busy += time.time() - t
+    if loader is not None:
+        loader.join()
+    t = time.time()
+    scanner.close()
+    busy += time.time() - t
+    dropped = 0
+    if log is not None:
+        log.close()
+        dropped = getattr(log, 'dropped', 0)
+    results.put((index, {'packets' : scanner.packets, 'bytes' : scanner.bytes, 'alerts' : scanner.alerts, 'busy' : busy,
+                         'dropped' : dropped, 'reloads' : reloads,
+                         'counters' : (bucketCounters.names, bucketCounters.summary()) if counters else None}))
+
+
+class ScanRuntime(object):
+    """
+    Class for scanning the packets of a capture on multiple worker processes.
+
+    Every packet is sent to the worker selected by the symmetric RSS hash of its
+    flow, so all the packets of a flow are scanned by the same worker and the
+    flow state is private to that worker. Worker processes are used in place of
+    threads so that the workers do not serialize on the interpreter lock.
+
+    The buckets can be reloaded, e.g. after an incremental rebuild, without
+    stopping: every worker loads the changed buckets in the background and then
+    switches to them, while its existing flows finish on the old ones.
+
+    If enabled, every worker also reads the hardware counters around the scans
+    of every bucket, and returns the events of every bucket with its counters.
+    Given (workers, size), every worker scans the buffers of at least the size,
+    e.g. the bodies of large downloads, on its own pool of the given workers.
+    """
+    # message which makes the workers reload the buckets
+    RELOAD = 'reload'
+
+    def __init__(self, directory, workers, cpus = None, stream = False, aggregate = None, prefilter = False,
+                 disabledFile = None, suppress = False, tenantsFile = None, logDirectory = None, binary = False,
+                 batchSize = 64, queueDepth = 64, counters = False, parallel = None):
+        self._workers = workers
+        self._batchSize = batchSize
+        self._reload = False
+        self._hash = RssHash()
+        self._queues = [Queue(queueDepth) for w in xrange(workers)]
+        self._results = Queue()
+        self._processes = []
+        for index in xrange(workers):
+            cpu = cpus[index % len(cpus)] if cpus else None
+            process = Process(target = _run_worker, args = (index, directory, self._queues[index], self._results,
+                                                            cpu, stream, aggregate, prefilter, disabledFile, suppress,
+                                                            tenantsFile, logDirectory, binary, counters, parallel))
+            process.start()
+            self._processes.append(process)
+        errors = [error for index, error in (self._results.get() for w in xrange(workers)) if error is not None]
+        if errors:
+            for process in self._processes:
+                process.terminate()
+            raise RuntimeError, 'Unable to start the workers.\n%s'%'\n'.join(errors)
+
+    def request_reload(self):
+        """
+        Makes the workers reload the buckets; safe to be called from a signal handler.
+        """
+        self._reload = True
+
+    def run(self, packets):
+        """
+        Dispatches the given packets to the workers and waits for them to finish.
+        Returns the counters of every worker.
+        """
+        batches = [[] for w in xrange(self._workers)]
+        for packet in packets:
+            if self._reload:
+                self._reload = False
+                for queue in self._queues:
+                    queue.put(self.RELOAD)
+            worker = self._hash(packet) % self._workers
+            batches[worker].append(packet)
+            if len(batches[worker]) == self._batchSize:
+                self._queues[worker].put(batches[worker])
+                batches[worker] = []
+        for worker in xrange(self._workers):
+            if batches[worker]:
+                self._queues[worker].put(batches[worker])
+            self._queues[worker].put(None)
+        counters = [None] * self._workers
+        for w in xrange(self._workers):
+            index, workerCounters = self._results.get()
+            counters[index] = workerCounters
+        for process in self._processes:
+            process.join()
+        return counters
+
+
+if __name__ == '__main__':
+    parser = ArgumentParser(description = 'Scan the packets of a pcap capture with the buckets generated by fastsnap.py.')
+    parser.add_argument('directory', help = 'the directory with the generated buckets')
+    parser.add_argument('pcap', help = 'the pcap capture to be scanned')
+    parser.add_argument('-w', '--workers', help = 'number of worker processes',
+                        type = int, default = 1, metavar = 'N')
+    parser.add_argument('-p', '--pin', help = 'CPUs to which the workers are pinned, e.g. 0-7,16-23',
+                        type = CpuList, metavar = 'CPUS')
+    parser.add_argument('-s', '--stream', help = 'scan the packets of every flow direction as a stream',
+                        action = 'store_true')
+    parser.add_argument('-a', '--aggregate', help = 'raise one alert per SID per buffer or stream, at its first or last match',
+                        choices = ('first', 'last'))
+    parser.add_argument('-f', '--prefilter', help = 'skip the buckets which cannot match a buffer',
+                        action = 'store_true')
+    parser.add_argument('-d', '--disable', help = 'file with the SIDs of the disabled rules, reapplied when modified',
+                        metavar = 'FILE')
+    parser.add_argument('--suppress', help = 'do not scan the components which only report disabled rules',
+                        action = 'store_true')
+    parser.add_argument('-t', '--tenants', help = 'JSON file with the networks and the rules of every tenant',
+                        metavar = 'FILE')
+    parser.add_argument('-l', '--log', help = 'directory to which the alerts are logged by every worker',
+                        metavar = 'DIR')
+    parser.add_argument('-b', '--binary', help = 'log the alerts in the binary format, off the scanning thread',
+                        action = 'store_true')
+    parser.add_argument('-c', '--counters', help = 'read the hardware counters of the scans of every bucket',
+                        action = 'store_true')
+    parser.add_argument('-P', '--parallel', help = 'scan the large buffers of every worker on N more processes',
+                        type = int, default = 0, metavar = 'N')
+    parser.add_argument('--parallel-size', help = 'size in bytes from which a buffer is scanned in parallel',
+                        type = int, default = 1 << 20, metavar = 'B')
+    args = parser.parse_args()
+
+    if args.log is not None and not os.path.exists(args.log):
+        os.makedirs(args.log)
+
+    runtime = ScanRuntime(args.directory, args.workers, args.pin, args.stream, args.aggregate, args.prefilter,
+                          args.disable, args.suppress, args.tenants, args.log, args.binary, counters = args.counters,
+                          parallel = (args.parallel, args.parallel_size) if args.parallel else None)
+    # the buckets are reloaded from the same directory on SIGHUP
+    signal.signal(signal.SIGHUP, lambda signum, frame : runtime.request_reload())
+    with PcapReader(args.pcap) as reader:
+        t = time.time()
+        counters = runtime.run(reader.packets())
+        t = time.time() - t
+
+    totals = dict((name, sum(c[name] for c in counters))
+                  for name in ('packets', 'bytes', 'alerts', 'busy', 'dropped', 'reloads'))
+    for index, c in enumerate(counters + [totals]):
+        name = 'total' if index == len(counters) else 'worker %d'%index
+        print '%s: %d packets, %d bytes, %d alerts, %d dropped, %d reloads, %.3f s busy, %.3f MB/s'%(name, c['packets'],
+              c['bytes'], c['alerts'], c['dropped'], c['reloads'], c['busy'],
+              c['bytes'] / (c['busy'] * 1e6) if c['busy'] > 0 else 0.0)
+    print 'Total time taken in scanning: %.3f s, %.3f MB/s'%(t, totals['bytes'] / (t * 1e6) if t > 0 else 0.0)
+    if args.counters:
+        names = counters[0]['counters'][0]
+        bucketCounters = BucketCounters.merge(c['counters'][1] for c in counters)
+        for bucket in sorted(bucketCounters):
+            print '%s: %s'%(bucket, BucketCounters.format(names, *bucketCounters[bucket]))
@@ -0,0 +1,444 @@
+#!/usr/bin/env python
+
+##
+# @file taskscheduler.py
+# @brief Work-stealing scheduling of the bucket-level scan tasks.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from argparse import ArgumentParser
+from collections import defaultdict, deque
+from multiprocessing import Event, Process, Queue
+from Queue import Empty
+import sys
+import time
+
+from flowtable import FlowTable
+from httpslicer import HttpSlicer
+from pcapreader import PcapReader
+from scanengine import ScanEngine
+from snapruntime import CpuList, FlowScanner, RssHash, TextAlertLog, set_affinity
+
+
+def _next_task(index, deques, steal):
+    """
+    Returns the next task from the deque of the given worker or, if it is empty
+    and stealing is enabled, from the deque of any other worker.
+    Returns the task and whether it was stolen, or None if no task was found.
+    """
+    try:
+        return deques[index].get_nowait(), False
+    except Empty:
+        pass
+    if steal:
+        for offset in xrange(1, len(deques)):
+            try:
+                return deques[(index + offset) % len(deques)].get_nowait(), True
+            except Empty:
+                pass
+    return None
+
+
+def _run_task_worker(index, directory, deques, results, done, cpu, prefilter, steal):
+    """
+    Executes the scan tasks of its own deque, and steals those of the other
+    workers when it is idle, until the scheduler signals that it is done.
+    """
+    try:
+        if cpu is not None:
+            set_affinity([cpu])
+        engine = ScanEngine(directory, prefilter = prefilter)
+    except Exception, e:
+        results.put((index, '%s: %s'%(type(e).__name__, e)))
+        return
+    # signal the scheduler that the worker is ready
+    results.put((index, None))
+    while True:
+        found = _next_task(index, deques, steal)
+        if found is None:
+            if done.is_set():
+                break
+            try:
+                found = deques[index].get(timeout = 0.001), False
+            except Empty:
+                continue
+        (taskId, bucket, keyword, items, states), stolen = found
+        t = time.time()
+        itemSids = []
+        for streamId, data, final in items:
+            # the scan state and the host state of the stream in the bucket, or its verification state
+            state, host = states.get((streamId, bucket)) or (None, {})
+            if bucket is None:
+                itemSids.append(engine.verify(keyword, data, host, final))
+            else:
+                reports, state = engine.scan_bucket(bucket, data, state, final)
+                itemSids.append(engine.resolve_bucket(bucket, data, reports, host, final))
+            # a stream is restarted after its final segment
+            states[(streamId, bucket)] = (state, host) if not final else None
+        results.put((taskId, index, stolen, itemSids, states, time.time() - t))
+
+
+class ScanTask(object):
+    """
+    Class for one task: the segments of a batch of flows scanned with one bucket.
+    """
+    __slots__ = ('taskId', 'key', 'owner', 'items', 'segments')
+
+    def __init__(self, taskId, key, owner):
+        self.taskId = taskId
+        self.key = key
+        self.owner = owner
+        # (stream, data, final) of every segment, sent to the worker
+        self.items = []
+        # (packet index, timestamp, flow key, keyword, offset) of every segment
+        self.segments = []
+
+
+class TaskScheduler(object):
+    """
+    Class for scanning the packets of a capture as tasks scheduled over
+    multiple worker processes with work stealing.
+
+    The packets are read in batches and their flows are sharded by the
+    symmetric RSS hash. The segments of every shard in a batch are then split
+    into one task per bucket, and one for the rules verified on the host, so
+    that a heavy bucket, e.g. general, does not delay the light ones. Every task
+    is queued on the worker owning its shard and an idle worker steals the tasks
+    of the others. The deques are multiprocessing queues, so a thief takes the
+    oldest task of a victim rather than the newest one.
+
+    In the stream mode, the tasks of the same shard and bucket, or verification,
+    are released one at a time, in order, and carry the scan or verification
+    states of their streams to whichever worker executes them; the states are
+    returned along with the reports. This keeps the order of the segments of
+    every flow without any state being shared between the workers.
+
+    If aggregation is enabled, one alert is raised per SID per buffer, once all
+    the tasks of the buffer are done, or per stream, either as soon as the SID
+    is first seen or once the stream has ended and all its tasks are done.
+    """
+    def __init__(self, directory, workers, cpus = None, stream = False, prefilter = False, steal = True,
+                 onAlert = None, batchSize = 64, shards = None, maxTasks = None, aggregate = None):
+        self._stream = stream
+        self._aggregate = aggregate
+        self._onAlert = onAlert if onAlert is not None else lambda *alert : None
+        self._batchSize = batchSize
+        self._shards = shards if shards is not None else 4 * workers
+        self._maxTasks = maxTasks if maxTasks is not None else 16 * workers
+        self._workers = workers
+        self._hash = RssHash()
+        engine = ScanEngine(directory)
+        self._slicer = HttpSlicer(engine.keywords())
+        self._keywordBuckets = dict((keyword, list(engine.buckets(keyword)) + [None]) for keyword in engine.keywords())
+        self._table = FlowTable(shards = 1, onEvict = self._finish)
+        self._deques = [Queue() for w in xrange(workers)]
+        self._results = Queue()
+        self._done = Event()
+        self._processes = []
+        for index in xrange(workers):
+            cpu = cpus[index % len(cpus)] if cpus else None
+            process = Process(target = _run_task_worker, args = (index, directory, self._deques, self._results,
+                                                                  self._done, cpu, prefilter, steal))
+            process.start()
+            self._processes.append(process)
+        errors = [error for index, error in (self._results.get() for w in xrange(workers)) if error is not None]
+        if errors:
+            for process in self._processes:
+                process.terminate()
+            raise RuntimeError, 'Unable to start the workers.\n%s'%'\n'.join(errors)
+
+    def _add_segment(self, shard, keyword, streamId, data, final, segment):
+        """
+        Adds a segment to the tasks of all the buckets of its keyword in the current batch.
+        """
+        for bucket in self._keywordBuckets.get(keyword, ()):
+            key = (shard, bucket, keyword)
+            task = self._batch.get(key)
+            if task is None:
+                task = ScanTask(self._nextTaskId, key, shard % self._workers)
+                self._nextTaskId += 1
+                self._batch[key] = task
+            task.items.append((streamId, data, final))
+            task.segments.append(segment)
+            if streamId is not None:
+                self._streamItems[streamId] += 1
+            if segment[0] is not None:
+                self._remaining[segment[0]] += 1
+
+    def _add_packet(self, packet, shard):
+        key = FlowScanner.flow_key(packet)
+        packetIndex = len(self._arrivals)
+        self._arrivals.append(time.time())
+        self._remaining.append(0)
+        buffers = self._slicer.buffers(packet.payload)
+        if self._stream:
+            flow = self._table.lookup(key, packet.timestamp)
+            direction = int((packet.srcAddr, packet.srcPort) != key[1:3])
+            for keyword, data in buffers.iteritems():
+                if not data:
+                    continue
+                streamKey = (direction, keyword)
+                held, offset, streamId = flow.states.get(streamKey, ('', 0, None))
+                if streamId is None:
+                    # a stream reusing the key of an ended one is kept apart from its tasks
+                    streamId = (key, streamKey, self._nextStreamId)
+                    self._nextStreamId += 1
+                data = held + data
+                if len(data) > 1:
+                    self._add_segment(shard, keyword, streamId, data[:-1], False,
+                                      (packetIndex, packet.timestamp, key, keyword, offset))
+                self._table.update(flow, streamKey, (data[-1], offset + len(data) - 1, streamId), packet.timestamp)
+            if packet.closing:
+                flow = self._table.remove(key)
+                if flow is not None:
+                    self._finish(flow, packetIndex)
+        else:
+            for keyword, data in buffers.iteritems():
+                if data:
+                    self._add_segment(shard, keyword, None, data, True, (packetIndex, packet.timestamp, key, keyword, 0))
+
+    def _finish(self, flow, packetIndex = None):
+        """
+        Adds the held back bytes of a flow which is no longer tracked as final segments.
+        """
+        shard = self._hash_key(flow.key) % self._shards
+        for streamKey, (held, offset, streamId) in flow.states.iteritems():
+            self._add_segment(shard, streamKey[1], streamId, held, True,
+                              (packetIndex, flow.lastSeen, flow.key, streamKey[1], offset))
+            self._closed[streamId] = flow.lastSeen
+            self._flush_stream(streamId)
+        flow.states.clear()
+
+    def _raise(self, timestamp, key, keyword, aggregated):
+        """
+        Raises one alert for every SID in the given aggregated reports.
+        """
+        for offset, sid in ScanEngine.aggregated_reports(aggregated, self._aggregate == 'last'):
+            self._alerts += 1
+            self._onAlert(timestamp, sid, key, keyword, offset)
+
+    def _flush_stream(self, streamId):
+        """
+        Raises the alerts of a stream at the last matches of its SIDs once it
+        has ended and all its tasks are done.
+        """
+        if streamId in self._closed and not self._streamItems[streamId]:
+            timestamp = self._closed.pop(streamId)
+            del self._streamItems[streamId]
+            aggregated = self._streamAlerts.pop(streamId, {})
+            if self._aggregate == 'last':
+                self._raise(timestamp, streamId[0], streamId[1][1], aggregated)
+
+    def _hash_key(self, key):
+        protocol, srcAddr, srcPort, dstAddr, dstPort = key
+        return self._hash(_FlowAddress(srcAddr, srcPort, dstAddr, dstPort))
+
+    def _dispatch(self):
+        """
+        Queues the tasks of the current batch, or holds them until the earlier
+        tasks of the same shard and bucket are done in the stream mode.
+        """
+        for key, task in self._batch.iteritems():
+            if self._stream:
+                if key in self._running:
+                    self._pending[key].append(task)
+                    continue
+                self._running.add(key)
+            self._release(task)
+        self._batch = {}
+
+    def _release(self, task):
+        self._tasks[task.taskId] = task
+        # the states of the streams in the bucket of the task, or their verification states
+        bucket = task.key[1]
+        states = dict(((streamId, bucket), self._states.get((streamId, bucket)))
+                      for streamId, data, final in task.items if streamId is not None)
+        self._deques[task.owner].put((task.taskId, task.key[1], task.key[2], task.items, states))
+
+    def _complete(self, result):
+        taskId, worker, stolen, itemSids, states, busy = result
+        task = self._tasks.pop(taskId)
+        self._counters[worker]['tasks'] += 1
+        self._counters[worker]['stolen'] += int(stolen)
+        self._counters[worker]['busy'] += busy
+        for streamKey, state in states.iteritems():
+            if state is None:
+                self._states.pop(streamKey, None)
+            else:
+                self._states[streamKey] = state
+        now = time.time()
+        for (packetIndex, timestamp, key, keyword, offset), (streamId, data, final), sids in \
+            zip(task.segments, task.items, itemSids):
+            if self._aggregate is None:
+                for reportOffset, sid in sids:
+                    self._alerts += 1
+                    self._onAlert(timestamp, sid, key, keyword, offset + reportOffset)
+            elif streamId is not None:
+                first = ScanEngine.aggregate_stream(self._streamAlerts.setdefault(streamId, {}),
+                                                    [(offset + reportOffset, sid) for reportOffset, sid in sids])
+                if self._aggregate == 'first':
+                    for reportOffset, sid in first:
+                        self._alerts += 1
+                        self._onAlert(timestamp, sid, key, keyword, reportOffset)
+            else:
+                ScanEngine.aggregate_stream(self._packetAlerts.setdefault((packetIndex, keyword), {}),
+                                            [(offset + reportOffset, sid) for reportOffset, sid in sids])
+            if streamId is not None:
+                self._streamItems[streamId] -= 1
+                self._flush_stream(streamId)
+            if packetIndex is not None:
+                self._remaining[packetIndex] -= 1
+                if not self._remaining[packetIndex]:
+                    self._latencies.append(now - self._arrivals[packetIndex])
+                    for packetKeyword in self._keywordBuckets:
+                        aggregated = self._packetAlerts.pop((packetIndex, packetKeyword), None)
+                        if aggregated:
+                            self._raise(timestamp, key, packetKeyword, aggregated)
+        if self._stream:
+            if self._pending[task.key]:
+                self._release(self._pending[task.key].popleft())
+            else:
+                self._running.discard(task.key)
+
+    def _wait(self, limit):
+        """
+        Completes the results of the workers until at most the given number of tasks are outstanding.
+        """
+        while len(self._tasks) + sum(len(p) for p in self._pending.itervalues()) > limit:
+            self._complete(self._results.get())
+
+    def run(self, packets):
+        """
+        Schedules the scan tasks of the given packets and waits for them to finish.
+        Returns the counters of every worker and the latencies of the packets.
+        """
+        self._counters = [{'tasks' : 0, 'stolen' : 0, 'busy' : 0.0} for w in xrange(self._workers)]
+        self._states = {}
+        self._tasks = {}
+        self._pending = defaultdict(deque)
+        self._running = set()
+        self._batch = {}
+        self._nextTaskId = 0
+        self._nextStreamId = 0
+        self._arrivals = []
+        self._remaining = []
+        self._latencies = []
+        self._alerts = 0
+        # aggregated reports of every buffer and stream, number of the tasks
+        # of every stream which are not done and streams which have ended
+        self._packetAlerts = {}
+        self._streamAlerts = {}
+        self._streamItems = defaultdict(int)
+        self._closed = {}
+        count = 0
+        for packet in packets:
+            self._add_packet(packet, self._hash(packet) % self._shards)
+            count += 1
+            if count % self._batchSize == 0:
+                self._dispatch()
+                self._wait(self._maxTasks)
+        self._table.expire(float('inf'))
+        self._dispatch()
+        self._wait(0)
+        self._done.set()
+        for process in self._processes:
+            process.join()
+        return self._counters, self._latencies
+
+
+class _FlowAddress(object):
+    """
+    Class for hashing the flow of a key in the same way as that of its packets.
+    """
+    __slots__ = ('srcAddr', 'srcPort', 'dstAddr', 'dstPort')
+
+    def __init__(self, srcAddr, srcPort, dstAddr, dstPort):
+        self.srcAddr = srcAddr
+        self.srcPort = srcPort
+        self.dstAddr = dstAddr
+        self.dstPort = dstPort
+
+
+def percentile(values, fraction):
+    """
+    Returns the given percentile of the sorted values.
+    """
+    if not values:
+        return 0.0
+    return values[min(len(values) - 1, int(fraction * len(values)))]
+
+
+if __name__ == '__main__':
+    parser = ArgumentParser(description = 'Scan the packets of a pcap capture as bucket-level tasks with work stealing.')
+    parser.add_argument('directory', help = 'the directory with the generated buckets')
+    parser.add_argument('pcap', help = 'the pcap capture to be scanned')
+    parser.add_argument('-w', '--workers', help = 'number of worker processes',
+                        type = int, default = 1, metavar = 'N')
+    parser.add_argument('-p', '--pin', help = 'CPUs to which the workers are pinned, e.g. 0-7,16-23',
+                        type = CpuList, metavar = 'CPUS')
+    parser.add_argument('-s', '--stream', help = 'scan the packets of every flow direction as a stream',
+                        action = 'store_true')
+    parser.add_argument('-a', '--aggregate', help = 'raise one alert per SID per buffer or stream, at its first or last match',
+                        choices = ('first', 'last'))
+    parser.add_argument('-f', '--prefilter', help = 'skip the buckets which cannot match a buffer',
+                        action = 'store_true')
+    parser.add_argument('--static', help = 'execute the tasks only on the workers owning their shards',
+                        action = 'store_true')
+    parser.add_argument('-b', '--batch', help = 'number of packets in a batch',
+                        type = int, default = 64, metavar = 'B')
+    parser.add_argument('-n', '--shards', help = 'number of flow shards, 4 per worker by default',
+                        type = int, metavar = 'S')
+    parser.add_argument('-l', '--log', help = 'file to which the alerts are logged',
+                        metavar = 'FILE')
+    parser.add_argument('--check', help = 'check that the alerts are those of a FlowScanner scanning the packets in order',
+                        action = 'store_true')
+    args = parser.parse_args()
+
+    log = TextAlertLog(args.log) if args.log is not None else None
+    alerts = []
+    def onAlert(timestamp, sid, key, keyword, offset):
+        if log is not None:
+            log(timestamp, sid, key, keyword, offset)
+        if args.check:
+            alerts.append((sid, key, keyword, offset))
+
+    scheduler = TaskScheduler(args.directory, args.workers, args.pin, args.stream, args.prefilter, not args.static,
+                              onAlert, args.batch, args.shards, aggregate = args.aggregate)
+    with PcapReader(args.pcap) as reader:
+        t = time.time()
+        counters, latencies = scheduler.run(reader.packets())
+        t = time.time() - t
+    if log is not None:
+        log.close()
+
+    for index, c in enumerate(counters):
+        print 'worker %d: %d tasks, %d stolen, %.3f s busy'%(index, c['tasks'], c['stolen'], c['busy'])
+    latencies.sort()
+    print 'Packet latency: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms'%tuple(1e3 * percentile(latencies, f)
+                                                                                     for f in (0.5, 0.9, 0.99, 1.0))
+    print 'Total time taken in scanning %d packets: %.3f s'%(len(latencies), t)
+
+    if args.check:
+        expected = []
+        scanner = FlowScanner(ScanEngine(args.directory), lambda timestamp, sid, key, keyword, offset :
+                              expected.append((sid, key, keyword, offset)), args.stream, args.aggregate)
+        with PcapReader(args.pcap) as reader:
+            for packet in reader.packets():
+                scanner.process(packet)
+        scanner.close()
+        if sorted(alerts) != sorted(expected):
+            print 'The %d alerts differ from the %d alerts of the sequential scan.'%(len(alerts), len(expected))
+            sys.exit(1)
+        print 'The %d alerts are those of the sequential scan.'%len(alerts)
@@ -0,0 +1,117 @@
+##
+# @file tenantpolicy.py
+# @brief Per-tenant selection of the rules reported from the shared buckets.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import exceptions
+import json
+import socket
+import struct
+
+
+class TenantException(exceptions.Exception):
+    pass
+
+
+class TenantPolicies(object):
+    """
+    Class for selecting the rules reported for the flows of every tenant.
+
+    The buckets are built once for the union of the rules of all the tenants.
+    The tenant of a flow is selected by the longest prefix, among the networks
+    of all the tenants, which contains either address of the flow; the flows of
+    no tenant belong to the default tenant, if any, and are otherwise not
+    reported. Every tenant then only sees the reports of its own rules.
+
+    The policies file is a JSON object of the form
+        {"tenants" : {"name" : {"networks" : ["10.1.0.0/16", ...], "sids" : [...]}, ...},
+         "default" : "name"}
+    where a tenant without "sids" is reported all the rules and "disabled"
+    may be given instead to list the rules which are not reported.
+    """
+    _address = struct.Struct('!I')
+
+    def __init__(self, policiesFile):
+        with open(policiesFile, 'rb') as policiesJson:
+            policies = json.load(policiesJson)
+        self.tenants = sorted(policies.get('tenants', {}).iterkeys())
+        # per tenant: the enabled SIDs, or None for all, and the disabled SIDs
+        self._enabled = []
+        self._disabled = []
+        # (prefix length, network, mask, tenant index), longest prefixes first
+        self._networks = []
+        for index, name in enumerate(self.tenants):
+            tenant = policies['tenants'][name]
+            self._enabled.append(self._parse_sids(name, tenant['sids']) if 'sids' in tenant else None)
+            self._disabled.append(self._parse_sids(name, tenant.get('disabled', ())))
+            for network in tenant.get('networks', ()):
+                self._networks.append(self._parse_network(network) + (index,))
+        self._networks.sort(reverse = True)
+        default = policies.get('default')
+        if default is not None and default not in self.tenants:
+            raise TenantException, '\nUnknown default tenant "%s".\n'%default
+        self._default = self.tenants.index(default) if default is not None else None
+
+    @staticmethod
+    def _parse_sids(name, sids):
+        """
+        Returns the given SIDs of a tenant as integers, since they may be given as strings.
+        """
+        try:
+            return frozenset(int(sid) for sid in sids)
+        except (ValueError, TypeError):
+            raise TenantException, '\nInvalid SIDs of the tenant "%s".\n'%name
+
+    @classmethod
+    def _parse_network(cls, network):
+        address, sep, length = network.partition('/')
+        try:
+            length = int(length) if sep else 32
+            value = cls._address.unpack(socket.inet_aton(address))[0]
+        except (ValueError, socket.error):
+            raise TenantException, '\nInvalid network "%s".\n'%network
+        if not 0 <= length <= 32:
+            raise TenantException, '\nInvalid prefix length of the network "%s".\n'%network
+        mask = ((1 << length) - 1) << (32 - length)
+        return length, value & mask, mask
+
+    def tenant(self, key):
+        """
+        Returns the index of the tenant of the flow with the given key, or None.
+        """
+        protocol, srcAddr, srcPort, dstAddr, dstPort = key
+        src = self._address.unpack(srcAddr)[0]
+        dst = self._address.unpack(dstAddr)[0]
+        for length, network, mask, index in self._networks:
+            if (src & mask) == network or (dst & mask) == network:
+                return index
+        return self._default
+
+    def allowed(self, tenant, sid):
+        """
+        Checks if the rule with the given SID is reported for the given tenant.
+        """
+        if tenant is None:
+            return False
+        enabled = self._enabled[tenant]
+        return (enabled is None or sid in enabled) and sid not in self._disabled[tenant]
+
+    def unused(self, sids):
+        """
+        Returns the given SIDs which are not reported for any tenant, and hence
+        need not be scanned for at all.
+        """
+        return set(sid for sid in sids if not any(self.allowed(tenant, sid) for tenant in xrange(len(self.tenants))))
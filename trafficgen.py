@@ -0,0 +1,268 @@
+#!/usr/bin/env python
+
+##
+# @file trafficgen.py
+# @brief Generation of synthetic traffic matching the converted rules.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from argparse import ArgumentParser
+import exceptions
+import random
+import re
+import socket
+import string
+import urllib
+
+from hostverifier import RuleVerifier, VerifierException, WindowVerifier
+from httpslicer import HttpSlicer
+from manifest import Manifest
+from pcapreader import Packet, PcapWriter
+from regexparser import RegexParser
+
+
+class TrafficException(exceptions.Exception):
+    pass
+
+
+class RuleSampler(object):
+    """
+    Class for generating the payloads which match, or nearly match, one rule.
+
+    The patterns of the rule are generated from their regexes, separated by
+    noise, and placed in the buffer of the keyword of the rule within an HTTP
+    message if needed. Every payload is sliced as the runtime does and checked
+    against the rule with the re module, so a matching payload is known to
+    match and a near miss, which has one byte of a pattern changed, is known
+    not to; a payload failing the check is generated again.
+    """
+    # message templates placing the data in the buffer of every keyword
+    _templates = {
+        'http_client_body' : 'POST / HTTP/1.1\r\nHost: example.com\r\nContent-Length: %(length)d\r\n\r\n%(data)s',
+        'http_cookie'      : 'GET / HTTP/1.1\r\nHost: example.com\r\nCookie: %(data)s\r\n\r\n',
+        'http_header'      : 'GET / HTTP/1.1\r\n%(data)s\r\n\r\n',
+        'http_method'      : '%(data)s / HTTP/1.1\r\nHost: example.com\r\n\r\n',
+        'http_uri'         : 'GET %(data)s HTTP/1.1\r\nHost: example.com\r\n\r\n',
+        'http_stat_code'   : 'HTTP/1.1 %(data)s OK\r\n\r\n',
+        'http_stat_msg'    : 'HTTP/1.1 200 %(data)s\r\n\r\n',
+    }
+    # keywords whose normalized buffer is percent-decoded
+    _decoded = frozenset(('http_uri', 'http_cookie'))
+
+    noiseSymbols = string.ascii_letters + string.digits + ' '
+
+    def __init__(self, keyword, sid, patterns, attempts = 16):
+        self.keyword = keyword
+        self.sid = sid
+        self._attempts = attempts
+        self._slicer = HttpSlicer([keyword])
+        self._compiled = [RuleVerifier.compile_pattern(pattern) for pattern in patterns]
+        # regex and flags of the patterns which have to be found
+        self._positives = [WindowVerifier.parse(expression) for expression, negation, dependent in patterns
+                           if not negation]
+        if not self._positives:
+            raise TrafficException, '\nRule with SID %d has no pattern to be generated.\n'%sid
+
+    @classmethod
+    def noise(cls, random, length):
+        return ''.join(random.choice(cls.noiseSymbols) for i in xrange(length))
+
+    def _payload(self, data):
+        base = self.keyword[:-len('_raw')] if self.keyword.endswith('_raw') else self.keyword
+        template = self._templates.get(base)
+        if template is None:
+            return data
+        if base in self._decoded and not self.keyword.endswith('_raw'):
+            data = urllib.quote(data, safe = '/?=&;:@!$\'()*+,-._~')
+        return template%{'data' : data, 'length' : len(data)}
+
+    def matches(self, payload):
+        """
+        Checks if the rule matches the buffer of its keyword in the given payload.
+        """
+        data = self._slicer.buffers(payload).get(self.keyword)
+        if data is None:
+            return False
+        return all(RuleVerifier.found(data, expression, dependent) != negation
+                   for expression, negation, dependent in self._compiled)
+
+    def _generate(self, random):
+        """
+        Returns the data with the generated patterns and their spans.
+        """
+        parts = []
+        spans = []
+        offset = 0
+        # the anchored patterns are placed first
+        positives = sorted(self._positives, key = lambda positive : (not positive[0].startswith('^'), random.random()))
+        for pattern, flags in positives:
+            if parts and not pattern.startswith('^'):
+                separator = self.noise(random, random.randint(0, 8))
+                parts.append(separator)
+                offset += len(separator)
+            generated = RegexParser(pattern, flags).generate(random)
+            parts.append(generated)
+            spans.append((offset, offset + len(generated)))
+            offset += len(generated)
+        return ''.join(parts), spans
+
+    def matching(self, random):
+        """
+        Returns a payload which matches the rule, or None if none was found.
+        """
+        for attempt in xrange(self._attempts):
+            try:
+                data, spans = self._generate(random)
+            except (IndexError, KeyError):
+                continue
+            payload = self._payload(data)
+            if self.matches(payload):
+                return payload
+        return None
+
+    def near_miss(self, random):
+        """
+        Returns a payload which matches the rule but for one changed byte of a
+        pattern, or None if none was found.
+        """
+        for attempt in xrange(self._attempts):
+            try:
+                data, spans = self._generate(random)
+            except (IndexError, KeyError):
+                continue
+            spans = [span for span in spans if span[1] > span[0]]
+            if not spans:
+                continue
+            start, end = random.choice(spans)
+            position = random.randint(start, end - 1)
+            data = data[:position] + chr(random.randint(0, 255)) + data[position + 1:]
+            payload = self._payload(data)
+            if not self.matches(payload):
+                return payload
+        return None
+
+
+class TrafficGenerator(object):
+    """
+    Class for assembling captures of synthetic traffic for the rules in the
+    manifest of a directory of buckets.
+
+    Every packet either matches a random rule, with the given alert density,
+    nearly matches one, with the given near miss density, or is background
+    noise; the packets are spread over the given number of TCP flows. The
+    traffic only depends on the seed, so every ruleset gets reproducible
+    benchmark captures.
+    """
+    def __init__(self, directory, seed = 0, sids = None):
+        manifest = Manifest(directory)
+        self._random = random.Random(seed)
+        self._samplers = []
+        self.skipped = []
+        for keyword in sorted(manifest.rules):
+            for sid, patterns in manifest.rules[keyword]:
+                if sids is not None and sid not in sids:
+                    continue
+                try:
+                    self._samplers.append(RuleSampler(keyword, sid, patterns))
+                except (TrafficException, VerifierException, re.error, OverflowError):
+                    self.skipped.append(sid)
+        if not self._samplers:
+            raise TrafficException, '\nNo rule of directory "%s" can be generated.\n'%directory
+
+    def payload(self, density, nearMisses, size):
+        """
+        Returns a random payload and the SID of the rule it matches, or None.
+        """
+        choice = self._random.random()
+        if choice < density + nearMisses:
+            sampler = self._random.choice(self._samplers)
+            if choice < density:
+                payload = sampler.matching(self._random)
+                if payload is not None:
+                    return payload, sampler.sid
+            else:
+                payload = sampler.near_miss(self._random)
+                if payload is not None:
+                    return payload, None
+        return RuleSampler.noise(self._random, size), None
+
+    def write(self, pcapFile, numPackets, density, nearMisses = 0.0, size = 512, numFlows = 16):
+        """
+        Writes the capture to the given file.
+        Returns the index of every matching packet with the SID of its rule.
+        """
+        flows = []
+        for f in xrange(numFlows):
+            srcAddr = socket.inet_aton('10.0.%d.%d'%(f >> 8 & 0xff, f & 0xff))
+            dstAddr = socket.inet_aton('10.1.%d.%d'%(f >> 8 & 0xff, f & 0xff))
+            flows.append([srcAddr, 1024 + f % 64511, dstAddr, 80, self._random.randint(0, 0xffffffff)])
+        expected = []
+        with PcapWriter(pcapFile) as writer:
+            for index in xrange(numPackets):
+                payload, sid = self.payload(density, nearMisses, size)
+                if sid is not None:
+                    expected.append((index, sid))
+                flow = flows[index % numFlows]
+                srcAddr, srcPort, dstAddr, dstPort, sequence = flow
+                packet = Packet(1500000000 + index * 1e-3, Packet.TCP, srcAddr, srcPort, dstAddr, dstPort, 0x18, payload)
+                writer.write(packet, sequence)
+                flow[4] = (sequence + len(payload)) & 0xffffffff
+        return expected
+
+
+if __name__ == '__main__':
+    def Fraction(value):
+        value = float(value)
+        if not 0.0 <= value <= 1.0:
+            raise ValueError
+        return value
+
+    parser = ArgumentParser(description = 'Generate a capture of synthetic traffic for the rules converted by fastsnap.py.')
+    parser.add_argument('directory', help = 'the directory with the generated buckets and their manifest')
+    parser.add_argument('-o', '--out', help = 'the capture to be written',
+                        required = True, metavar = 'FILE')
+    parser.add_argument('-n', '--packets', help = 'number of packets',
+                        type = int, default = 10000, metavar = 'N')
+    parser.add_argument('-d', '--density', help = 'fraction of the packets which match a rule',
+                        type = Fraction, default = 0.01, metavar = 'F')
+    parser.add_argument('-m', '--nearmisses', help = 'fraction of the packets which nearly match a rule',
+                        type = Fraction, default = 0.0, metavar = 'F')
+    parser.add_argument('-p', '--payload', help = 'size of the payload of the noise packets in bytes',
+                        type = int, default = 512, metavar = 'B')
+    parser.add_argument('-f', '--flows', help = 'number of TCP flows',
+                        type = int, default = 16, metavar = 'N')
+    parser.add_argument('-s', '--seed', help = 'seed of the generator',
+                        type = int, default = 0, metavar = 'S')
+    parser.add_argument('--sids', help = 'only generate the rules with the SIDs in the given file, one per line',
+                        metavar = 'FILE')
+    parser.add_argument('-e', '--expected', help = 'file to which the index and SID of every matching packet is written',
+                        metavar = 'FILE')
+    args = parser.parse_args()
+
+    if args.density + args.nearmisses > 1.0:
+        parser.error('the densities of the matches and near misses add up to more than one')
+    sids = None
+    if args.sids is not None:
+        with open(args.sids, 'rb') as sidsFile:
+            sids = set(int(line) for line in sidsFile if line.strip())
+    generator = TrafficGenerator(args.directory, args.seed, sids)
+    expected = generator.write(args.out, args.packets, args.density, args.nearmisses, args.payload, args.flows)
+    if args.expected is not None:
+        with open(args.expected, 'wb') as expectedFile:
+            for index, sid in expected:
+                expectedFile.write('%d %d\n'%(index, sid))
+    print 'Wrote %d packets, %d matching, over %d flows'%(args.packets, len(expected), args.flows)
+    if generator.skipped:
+        print 'Skipped %d rules which cannot be generated'%len(generator.skipped)
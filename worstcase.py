@@ -0,0 +1,276 @@
+#!/usr/bin/env python
+
+##
+# @file worstcase.py
+# @brief Search for the inputs which are the slowest to scan for every bucket.
+#
+# Copyright 2018 Georgia Institute of Technology
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#  http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+from argparse import ArgumentParser
+import exceptions
+import json
+import os
+import random
+import time
+
+from lazydfa import LazyDfa
+from scanengine import ScanEngine
+
+
+class WorstCaseException(exceptions.Exception):
+    pass
+
+
+class ActiveCost(object):
+    """
+    Class for measuring the active STEs, i.e. the enabled STEs which are tested
+    and the matched STEs whose successors are enabled, per scanned byte.
+    """
+    name = 'active STEs'
+
+    def __init__(self, simulator):
+        self._simulator = simulator
+
+    def __call__(self, data):
+        simulator = self._simulator
+        total = 0
+        for enabled, matched in simulator.frontiers(data):
+            total += bin(enabled).count('1') + bin(matched).count('1')
+        return float(total) / max(len(data), 1)
+
+    def guided(self, random, length, symbols):
+        """
+        Returns an input built by choosing, for every byte, a symbol which
+        maximizes the STEs matched and enabled by it.
+        """
+        simulator = self._simulator
+        enabled = 0
+        data = []
+        for position in xrange(length):
+            best = None
+            for symbol in symbols:
+                matched, following = simulator.step(enabled, symbol, position == 0)
+                score = (bin(matched).count('1') + bin(following).count('1'), random.random())
+                if best is None or score > best[0]:
+                    best = (score, symbol, following)
+            data.append(chr(best[1]))
+            enabled = best[2]
+        return ''.join(data)
+
+
+class MissCost(object):
+    """
+    Class for measuring the states computed by a lazy DFA per scanned byte,
+    starting from an empty cache.
+    """
+    name = 'DFA misses'
+
+    def __init__(self, dfa):
+        self._dfa = dfa
+
+    def __call__(self, data):
+        self._dfa.flush()
+        misses = self._dfa.misses
+        self._dfa.scan(data)
+        return float(self._dfa.misses - misses) / max(len(data), 1)
+
+    def guided(self, random, length, symbols):
+        """
+        Returns an input built by choosing, for every byte, a symbol leading
+        to a set of enabled STEs not seen yet, preferring the largest sets.
+        """
+        simulator = self._dfa.simulator
+        enabled = 0
+        seen = set([0])
+        data = []
+        for position in xrange(length):
+            best = None
+            for symbol in symbols:
+                following = simulator.step(enabled, symbol, position == 0)[1]
+                score = (following not in seen, bin(following).count('1'), random.random())
+                if best is None or score > best[0]:
+                    best = (score, symbol, following)
+            data.append(chr(best[1]))
+            enabled = best[2]
+            seen.add(enabled)
+        return ''.join(data)
+
+
+class WorstCaseSearch(object):
+    """
+    Class for searching the inputs of a given length with the highest cost per
+    byte for a bucket: the active STEs for the simulated buckets and the cache
+    misses for the lazy DFA buckets.
+
+    The search starts from random inputs, an input built greedily from the
+    structure of the automaton and any earlier corpus, and then mutates the
+    worst inputs found so far, keeping a mutant if it costs more than any of
+    them. Only the symbols distinguished by the automaton are tried.
+    """
+    def __init__(self, engine, length, seed = 0, corpusSize = 8):
+        if length < 1 or corpusSize < 1:
+            raise WorstCaseException, '\nThe length of the inputs and the size of the corpus must be positive.\n'
+        if corpusSize > 256 ** length:
+            # the corpus could never be filled with distinct inputs
+            raise WorstCaseException, '\nThe corpus of %d inputs exceeds the %d distinct inputs of %d bytes.\n'%(
+                corpusSize, 256 ** length, length)
+        if isinstance(engine, LazyDfa):
+            self._cost = MissCost(engine)
+            simulator = engine.simulator
+        else:
+            self._cost = ActiveCost(engine)
+            simulator = engine
+        self._engine = engine
+        self._length = length
+        self._random = random.Random(seed)
+        self._corpusSize = corpusSize
+        self._symbols = simulator.symbol_classes()[0]
+        # (cost, input) from the worst
+        self.corpus = []
+
+    @property
+    def metric(self):
+        return self._cost.name
+
+    def _add(self, data):
+        data = (data * (self._length // max(len(data), 1) + 1))[:self._length] if data else data
+        if not data or any(data == known for cost, known in self.corpus):
+            return False
+        cost = self._cost(data)
+        if len(self.corpus) == self._corpusSize and cost <= self.corpus[-1][0]:
+            return False
+        self.corpus.append((cost, data))
+        self.corpus.sort(key = lambda entry : -entry[0])
+        del self.corpus[self._corpusSize:]
+        return True
+
+    def random_input(self):
+        return ''.join(chr(self._random.randint(0, 255)) for i in xrange(self._length))
+
+    def _mutate(self, data):
+        random = self._random
+        position = random.randrange(len(data))
+        mutation = random.randrange(4)
+        if mutation == 0:
+            # replace a byte with a symbol distinguished by the automaton
+            return data[:position] + chr(random.choice(self._symbols)) + data[position + 1:]
+        if mutation == 1:
+            return data[:position] + chr(random.randint(0, 255)) + data[position + 1:]
+        if mutation == 2:
+            # repeat a chunk of the input from the given position
+            start = random.randrange(len(data))
+            chunk = data[start:start + random.randint(1, 64)]
+            return data[:position] + chunk + data[position:]
+        # splice with another input of the corpus
+        other = random.choice(self.corpus)[1]
+        return data[:position] + other[position:]
+
+    def search(self, iterations, seeds = ()):
+        """
+        Runs the search for the given number of mutations, starting with the given inputs.
+        Returns the worst cost per byte found.
+        """
+        for data in seeds:
+            self._add(data)
+        self._add(self._cost.guided(self._random, self._length, self._symbols))
+        while len(self.corpus) < self._corpusSize:
+            self._add(self.random_input())
+        for i in xrange(iterations):
+            self._add(self._mutate(self._random.choice(self.corpus)[1]))
+        return self.corpus[0][0]
+
+    def cost(self, data):
+        return self._cost(data)
+
+    def throughput(self, data, repeats = 3):
+        """
+        Returns the best of the measured scan rates of the given input in bytes per second.
+        """
+        best = None
+        for r in xrange(repeats):
+            if isinstance(self._engine, LazyDfa):
+                self._engine.flush()
+            t = time.time()
+            self._engine.scan(data)
+            t = time.time() - t
+            best = t if best is None else min(best, t)
+        return len(data) / max(best, 1e-9)
+
+
+if __name__ == '__main__':
+    def Positive(value):
+        value = int(value)
+        if value < 1:
+            raise ValueError
+        return value
+
+    parser = ArgumentParser(description = 'Search for the worst-case inputs of the buckets generated by fastsnap.py.')
+    parser.add_argument('directory', help = 'the directory with the generated buckets')
+    parser.add_argument('-o', '--out', help = 'directory of the corpus of worst-case inputs, which seeds later searches',
+                        required = True, metavar = 'DIR')
+    parser.add_argument('-b', '--buckets', help = 'comma separated buckets to be searched, all by default',
+                        type = lambda buckets : buckets.split(','), metavar = 'B')
+    parser.add_argument('-l', '--length', help = 'length of the inputs in bytes',
+                        type = Positive, default = 1024, metavar = 'N')
+    parser.add_argument('-n', '--iterations', help = 'number of mutations tried per bucket',
+                        type = int, default = 500, metavar = 'N')
+    parser.add_argument('-k', '--keep', help = 'number of worst inputs kept per bucket',
+                        type = Positive, default = 4, metavar = 'K')
+    parser.add_argument('-s', '--seed', help = 'seed of the search',
+                        type = int, default = 0, metavar = 'S')
+    args = parser.parse_args()
+
+    if not os.path.exists(args.out):
+        os.makedirs(args.out)
+    engine = ScanEngine(args.directory, args.buckets)
+    summaryFile = os.path.join(args.out, 'worstcase.json')
+    summary = {}
+    if os.path.exists(summaryFile):
+        with open(summaryFile, 'rb') as summaryJson:
+            summary = json.load(summaryJson)
+    print '%-28s %-12s %10s %10s %12s %12s'%('bucket', 'metric', 'random', 'worst', 'random B/s', 'worst B/s')
+    for bucket in engine.buckets():
+        search = WorstCaseSearch(engine.engine(bucket), args.length, args.seed, args.keep)
+        # the inputs saved by earlier searches seed this one
+        seeds = []
+        seedFiles = [fileName for fileName in sorted(os.listdir(args.out))
+                     if fileName.startswith(bucket + '.') and fileName.endswith('.bin')]
+        for fileName in seedFiles:
+            with open(os.path.join(args.out, fileName), 'rb') as seedFile:
+                seeds.append(seedFile.read())
+        baseline = search.random_input()
+        worst = search.search(args.iterations, seeds)
+        # the old corpus is only replaced once the new one is written
+        corpusFiles = ['%s.%d.bin'%(bucket, rank) for rank in xrange(len(search.corpus))]
+        for fileName, (cost, data) in zip(corpusFiles, search.corpus):
+            with open(os.path.join(args.out, fileName + '.tmp'), 'wb') as corpusFile:
+                corpusFile.write(data)
+        for fileName in corpusFiles:
+            os.rename(os.path.join(args.out, fileName + '.tmp'), os.path.join(args.out, fileName))
+        for fileName in set(seedFiles).difference(corpusFiles):
+            os.remove(os.path.join(args.out, fileName))
+        summary[bucket] = {
+            'metric' : search.metric,
+            'length' : args.length,
+            'random_cost' : search.cost(baseline),
+            'worst_cost' : worst,
+            'random_bytes_per_second' : search.throughput(baseline),
+            'worst_bytes_per_second' : search.throughput(search.corpus[0][1]),
+        }
+        b = summary[bucket]
+        print '%-28s %-12s %10.3f %10.3f %12.0f %12.0f'%(bucket, b['metric'], b['random_cost'], b['worst_cost'],
+              b['random_bytes_per_second'], b['worst_bytes_per_second'])
+    with open(summaryFile, 'wb') as summaryJson:
+        json.dump(summary, summaryJson, indent = 1, sort_keys = True)